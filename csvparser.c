@@ -3,9 +3,23 @@
 #include <ctype.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+typedef struct KeyIndex KeyIndex;
 
 typedef struct CsvParser {
   file_t* stream;    // file_t pointer corresponding to the file stream.
@@ -16,12 +30,40 @@ typedef struct CsvParser {
   char comment;      // Comment character
   bool has_header;   // Whether the CSV file has a header
   bool skip_header;  // Whether to skip the header when parsing
+  bool lenient;        // Whether to skip invalid rows instead of stopping
+  bool validate_utf8;  // Whether to reject rows that are not valid UTF-8
   Arena* arena;      // Arena for memory allocation
+  uint64_t offset;       // Byte offset of the next line read
+  uint64_t line_offset;  // Byte offset of the last line read
+  char* next_line;       // Line buffer of csvparser_next, allocated on first call
+  CsvRow next_row;       // Row returned by csvparser_next, its fields pointing into next_line
+  size_t next_fields;    // Number of fields, detected on the first call to csvparser_next
+  size_t next_records;   // Data rows seen by csvparser_next, valid or not
+  bool next_done;        // Whether csvparser_next reached the end or an error
+  KeyIndex* key_index;   // Hash index built by csvparser_build_key_index
+  CsvError* errors;      // Errors found while parsing
+  size_t num_errors;     // Number of errors
+  size_t cap_errors;     // Capacity of errors
+  void* cache_map;   // Mapped snapshot backing the fields when loaded from cache
+  size_t cache_len;  // Length of cache_map in bytes
 } CsvParser;
 
+// UTF-8 byte order mark, stripped from the start of the file.
+#define CSV_UTF8_BOM "\xEF\xBB\xBF"
+
+// Bounds of one field in a line.
+typedef struct FieldSpan {
+  const char* start;  // Field contents, without surrounding quotes
+  size_t len;         // Length of the contents
+  const char* tail;   // Stray text after a closing quote, if any
+  size_t tail_len;    // Length of tail
+  bool escaped;       // Whether the contents contain doubled quotes
+} FieldSpan;
+
 typedef struct LineArgs {
-  Arena* arena;
+  Arena* arena;      // Arena for the fields, or NULL to split in_place
   const char* line;
+  char* in_place;    // line itself, written to when arena is NULL
   size_t num_fields;
   size_t rowIndex;
   CsvRow* row;
@@ -30,8 +72,19 @@ typedef struct LineArgs {
 } LineArgs;
 
 static size_t line_count(CsvParser* self);
+static void csv_close_stream(CsvParser* self);
+static size_t csv_count_records(const char* data, size_t len, char comment, size_t nthreads);
 static size_t get_num_fields(const char* line, char delim, char quote);
-static bool parse_csv_line(LineArgs* args);
+static CsvErrorCode parse_csv_line(LineArgs* args);
+static void csv_report_error(CsvParser* self, CsvErrorCode code, size_t rowIndex, uint64_t offset);
+static size_t csv_detect_num_fields(CsvParser* self, char* line);
+static size_t csv_read_line(CsvParser* self, FILE* fp, char* line);
+static CsvErrorCode csv_parse_record(CsvParser* self, Arena* arena, char* line, size_t len, size_t num_fields,
+                                     size_t rowIndex, CsvRow* row, uint64_t* errOffset);
+static void* csv_map_stream(FILE* fp, size_t* len);
+static void* csv_map_file(const char* path, size_t* len);
+static void csv_unmap_file(void* addr, size_t len);
+static uint64_t csv_hash_key(const char* key);
 
 CsvParser* csvparser_new(const char* filename) {
   CsvParser* parser = malloc(sizeof(CsvParser));
@@ -58,6 +111,19 @@ CsvParser* csvparser_new(const char* filename) {
   parser->arena = arena;
   parser->num_rows = 0;
   parser->stream = f;
+  parser->cache_map = NULL;
+  parser->cache_len = 0;
+  parser->offset = 0;
+  parser->line_offset = 0;
+  parser->next_line = NULL;
+  parser->next_row = (CsvRow){0};
+  parser->next_fields = 0;
+  parser->next_records = 0;
+  parser->next_done = false;
+  parser->key_index = NULL;
+  parser->errors = NULL;
+  parser->num_errors = 0;
+  parser->cap_errors = 0;
 
   // Set default configuration
   CSV_SETCONFIG(parser);
@@ -67,6 +133,11 @@ CsvParser* csvparser_new(const char* filename) {
 
 // Allocate memory for rows and set num_rows.
 static CsvRow** csv_allocate_rows(Arena* arena, size_t num_rows) {
+  if (num_rows > SIZE_MAX / sizeof(CsvRow*)) {
+    fprintf(stderr, "csv_allocate_rows(): too many rows: %zu\n", num_rows);
+    return NULL;
+  }
+
   CsvRow** rows = arena_alloc(arena, num_rows * sizeof(CsvRow*));
   if (!rows) {
     fprintf(stderr, "csv_allocate_rows(): error allocating memory for CsvRow*\n");
@@ -83,171 +154,229 @@ static CsvRow** csv_allocate_rows(Arena* arena, size_t num_rows) {
   return rows;
 }
 
-CsvRow** csvparser_parse(CsvParser* self) {
-  // read num_rows and allocate them on heap.
-  self->num_rows = line_count(self);
-  self->rows = csv_allocate_rows(self->arena, self->num_rows);
+// Rows preallocated by csv_parse_rows when the caller has no estimate.
+#define CSV_ROWS_INITIAL_CAPACITY 1024
+
+// Double the capacity of self->rows, keeping the rows parsed so far.
+// The old array stays in the arena, so the total is at most twice the final size.
+static bool csv_grow_rows(CsvParser* self, size_t* capacity) {
+  if (*capacity > SIZE_MAX / 2 / sizeof(CsvRow*)) {
+    fprintf(stderr, "csv_grow_rows(): too many rows\n");
+    return false;
+  }
+
+  CsvRow** rows = arena_alloc(self->arena, *capacity * 2 * sizeof(CsvRow*));
+  if (!rows) {
+    fprintf(stderr, "csv_grow_rows(): error allocating memory for CsvRow*\n");
+    return false;
+  }
+
+  memcpy(rows, self->rows, *capacity * sizeof(CsvRow*));
+  self->rows = rows;
+  *capacity *= 2;
+  return true;
+}
+
+// Parse up to max_rows rows into self->rows, passing each to callback if given.
+// expected_rows is a size hint: the array starts with that capacity and grows
+// as rows are parsed, so memory follows the file rather than max_rows.
+// Stops at the first invalid row. Sets num_rows to the number of rows parsed.
+static bool csv_parse_rows(CsvParser* self, size_t max_rows, size_t expected_rows, RowCallback callback) {
+  size_t capacity = expected_rows < max_rows ? expected_rows : max_rows;
+  if (capacity == 0) {
+    capacity = 1;
+  }
+
+  self->num_rows = 0;
+  self->rows = arena_alloc(self->arena, capacity * sizeof(CsvRow*));
   if (!self->rows) {
-    return NULL;
+    fprintf(stderr, "csv_parse_rows(): error allocating memory for CsvRow*\n");
+    csv_close_stream(self);
+    return false;
   }
 
   char line[MAX_FIELD_SIZE] = {0};
   size_t rowIndex = 0;
+  size_t recordIndex = 0;  // Counts invalid rows too
   bool headerSkipped = false;
   FILE* fp = file_fp(self->stream);
 
-
-  // Read one line to determine the number of fields in the CSV file
-  if (!fgets(line, MAX_FIELD_SIZE, fp)) {
-    file_close(self->stream);
-    return NULL;
-  }
-  // Reset the file pointer to the beginning of the file
-  file_seek(self->stream, 0, SEEK_SET);
-
   // Get the number of fields in the CSV file
-  size_t num_fields = get_num_fields(line, self->delim, self->quote);
+  size_t num_fields = csv_detect_num_fields(self, line);
   if (num_fields == 0) {
-    fprintf(stderr, "Error: no fields found in CSV file\n");
-    file_close(self->stream);
-    return NULL;
+    csv_close_stream(self);
+    return false;
   }
 
-  while (fgets(line, MAX_FIELD_SIZE, fp) && rowIndex < self->num_rows) {
-    // trim white space from end of line and skip empty lines
-    char* end = line + strlen(line) - 1;
-    while (end > line && isspace(*end)) {
-      end--;
-    }
-
-    // If the line is empty, skip it
-    if (end == line) {
+  CsvRow* row = NULL;  // Reused for the next line after an invalid one
+  size_t len;
+  while (rowIndex < max_rows && (len = csv_read_line(self, fp, line)) > 0) {
+    if (self->has_header && self->skip_header && rowIndex == 0 && !headerSkipped) {
+      headerSkipped = true;
       continue;
     }
 
-    // Terminate the line with a null character
-    end[1] = '\0';
-
-    // skip comment lines
-    if (line[0] == self->comment) {
-      continue;
+    if (!row && !(row = arena_alloc(self->arena, sizeof(CsvRow)))) {
+      fprintf(stderr, "csv_parse_rows(): error allocating memory for CsvRow: %zu\n", rowIndex);
+      break;
     }
 
-    if (self->has_header && self->skip_header && rowIndex == 0 && !headerSkipped) {
-      headerSkipped = true;
-      continue;
+    uint64_t errOffset;
+    CsvErrorCode err = csv_parse_record(self, self->arena, line, len, num_fields, recordIndex, row, &errOffset);
+    recordIndex++;
+    if (err != CSV_ERROR_NONE) {
+      csv_report_error(self, err, recordIndex - 1, errOffset);
+      if (self->lenient) {
+        continue;  // Reuse the row for the next line.
+      }
+      break;
     }
 
-    LineArgs args = {
-      .arena = self->arena,
-      .line = line,
-      .rowIndex = rowIndex,
-      .row = self->rows[rowIndex],
-      .delim = self->delim,
-      .quote = self->quote,
-      .num_fields = num_fields,
-    };
-
-    if (!parse_csv_line(&args)) {
+    if (rowIndex == capacity && !csv_grow_rows(self, &capacity)) {
       break;
     }
+    self->rows[rowIndex] = row;
+    row = NULL;
 
+    // Pass the processed row to the caller.
+    if (callback) {
+      callback(rowIndex, self->rows[rowIndex]);
+    }
     rowIndex++;
   }
 
-  file_close(self->stream);
+  // Only expose rows that were actually parsed.
+  self->num_rows = rowIndex;
+  csv_close_stream(self);
+  return true;
+}
+
+CsvRow** csvparser_parse(CsvParser* self) {
+  // Preallocate the rows the file is expected to hold; lines longer than
+  // MAX_FIELD_SIZE may still make more, so the count is not a limit.
+  if (!csv_parse_rows(self, SIZE_MAX, line_count(self), NULL)) {
+    return NULL;
+  }
   return self->rows;
 }
 
 void csvparser_parse_async(CsvParser* self, RowCallback callback, size_t maxrows) {
-  self->num_rows = line_count(self);
-
-  size_t rowIndex = 0;
-  bool headerSkipped = false;
-  char line[MAX_FIELD_SIZE] = {0};
-
-  // Limit the number of rows to parse if maxrows is set
-  self->num_rows = (maxrows > 0 && maxrows < self->num_rows) ? maxrows : self->num_rows;
-  self->rows = csv_allocate_rows(self->arena, self->num_rows);
-  if (!self->rows) {
-    return;
+  // With a row limit there is no need to count the lines of the whole file first.
+  if (maxrows > 0) {
+    csv_parse_rows(self, maxrows, CSV_ROWS_INITIAL_CAPACITY, callback);
+  } else {
+    csv_parse_rows(self, SIZE_MAX, line_count(self), callback);
   }
+}
 
-  FILE* fp = file_fp(self->stream);
-  // Read one line to determine the number of fields in the CSV file
-  if (!fgets(line, MAX_FIELD_SIZE, fp)) {
-    file_close(self->stream);
-    return;
+CsvRow** csvparser_head(CsvParser* self, size_t n) {
+  if (!csv_parse_rows(self, n, CSV_ROWS_INITIAL_CAPACITY, NULL)) {
+    return NULL;
   }
-  // Reset the file pointer to the beginning of the file
-  file_seek(self->stream, 0, SEEK_SET);
+  return self->rows;
+}
 
-  // Get the number of fields in the CSV file
-  size_t num_fields = get_num_fields(line, self->delim, self->quote);
-  if (num_fields == 0) {
-    fprintf(stderr, "Error: no fields found in CSV file\n");
-    file_close(self->stream);
-    return;
+CsvRow* csvparser_next(CsvParser* self) {
+  if (self->next_done) {
+    return NULL;
   }
 
-  while (fgets(line, MAX_FIELD_SIZE, fp) && rowIndex < self->num_rows) {
-    // trim white space from end of line and skip empty lines
-    char* end = line + strlen(line) - 1;
-    while (end > line && isspace(*end)) {
-      end--;
-    }
+  FILE* fp = self->stream ? file_fp(self->stream) : NULL;
+  if (!self->next_line) {
+    self->next_line = arena_alloc(self->arena, MAX_FIELD_SIZE);
+    self->next_fields = self->next_line ? csv_detect_num_fields(self, self->next_line) : 0;
 
-    // If the line is empty, skip it
-    if (end == line) {
-      continue;
+    // One row is reused for every line: nothing is allocated per row.
+    if (self->next_fields > 0) {
+      self->next_row.fields = arena_alloc(self->arena, self->next_fields * sizeof(char*));
+      if (!self->next_row.fields) {
+        self->next_fields = 0;
+      }
     }
 
-    // Terminate the line with a null character
-    end[1] = '\0';
-
-    // skip comment lines
-    if (line[0] == self->comment) {
-      continue;
+    // Skip the header, like csv_parse_rows.
+    if (self->next_fields > 0 && self->has_header && self->skip_header) {
+      csv_read_line(self, fp, self->next_line);
     }
+  }
 
-    if (self->has_header && self->skip_header && rowIndex == 0 && !headerSkipped) {
-      headerSkipped = true;
-      continue;
+  size_t len;
+  while (self->next_fields > 0 && (len = csv_read_line(self, fp, self->next_line)) > 0) {
+    uint64_t errOffset;
+    size_t recordIndex = self->next_records++;
+    CsvErrorCode err = csv_parse_record(self, NULL, self->next_line, len, self->next_fields, recordIndex,
+                                        &self->next_row, &errOffset);
+    if (err == CSV_ERROR_NONE) {
+      return &self->next_row;
     }
 
-    LineArgs args = {
-      .arena = self->arena,
-      .line = line,
-      .rowIndex = rowIndex,
-      .row = self->rows[rowIndex],
-      .delim = self->delim,
-      .quote = self->quote,
-      .num_fields = num_fields,
-    };
-
-    if (!parse_csv_line(&args)) {
+    csv_report_error(self, err, recordIndex, errOffset);
+    if (!self->lenient) {
       break;
     }
-
-    // Pass the processed row to the caller.
-    callback(rowIndex, self->rows[rowIndex]);
-    rowIndex++;
   }
 
-  file_close(self->stream);
+  self->next_done = true;
+  csv_close_stream(self);
+  return NULL;
 }
 
 size_t csvparser_numrows(const CsvParser* self) {
   return self->num_rows;
 }
 
+CsvRow** csvparser_rows(const CsvParser* self) {
+  return self->rows;
+}
+
+const CsvError* csvparser_errors(const CsvParser* self, size_t* count) {
+  if (count) {
+    *count = self->num_errors;
+  }
+  return self->errors;
+}
+
+const char* csvparser_strerror(CsvErrorCode code) {
+  switch (code) {
+    case CSV_ERROR_NONE:
+      return "no error";
+    case CSV_ERROR_FIELD_COUNT:
+      return "invalid number of fields";
+    case CSV_ERROR_UNTERMINATED_QUOTE:
+      return "unterminated quoted field";
+    case CSV_ERROR_ALLOC:
+      return "unable to allocate memory";
+    case CSV_ERROR_INVALID_UTF8:
+      return "invalid UTF-8 sequence";
+  }
+  return "unknown error";
+}
+
+// Close the file stream once; later calls do nothing.
+static void csv_close_stream(CsvParser* self) {
+  if (self->stream) {
+    file_close(self->stream);
+    self->stream = NULL;
+  }
+}
+
 void csvparser_free(CsvParser* self) {
   if (!self)
     return;
 
+  // The stream is still open if the rows were never read to the end.
+  csv_close_stream(self);
+
   // The row are allocated in the arena, so we only need to free the arena.
   arena_destroy(self->arena);
 
+  free(self->errors);
+
+  // Fields loaded from a snapshot point into the mapping.
+  if (self->cache_map) {
+    csv_unmap_file(self->cache_map, self->cache_len);
+  }
+
   free(self);
   self = NULL;
 }
@@ -267,139 +396,1748 @@ void csvparser_setconfig(CsvParser* parser, CsvConfig config) {
 
   parser->has_header = config.has_header;
   parser->skip_header = config.skip_header;
+  parser->lenient = config.lenient;
+  parser->validate_utf8 = config.validate_utf8;
+}
+
+// Scan the field starting at p, following RFC 4180: a field starting with the
+// quote character (after optional spaces) runs to the matching closing quote,
+// with doubled quotes inside it; any other field runs to the next delimiter and
+// takes quotes literally. Returns a pointer to the delimiter or NUL ending the
+// field, or NULL if a quoted field is not terminated.
+static const char* csv_scan_field(const char* p, char delim, char quote, FieldSpan* span) {
+  const char* q = p;
+  while (*q == ' ' && quote != ' ' && delim != ' ') {
+    q++;
+  }
+
+  span->escaped = false;
+  span->tail = NULL;
+  span->tail_len = 0;
+
+  if (*q != quote) {
+    // Unquoted: the common case, located with strchr.
+    const char* end = strchr(p, delim);
+    if (!end) {
+      end = p + strlen(p);
+    }
+    span->start = p;
+    span->len = (size_t)(end - p);
+    return end;
+  }
+
+  span->start = ++q;
+  for (;;) {
+    q = strchr(q, quote);
+    if (!q) {
+      return NULL;
+    }
+    if (q[1] != quote) {
+      break;
+    }
+    span->escaped = true;
+    q += 2;
+  }
+  span->len = (size_t)(q - span->start);
+
+  // Text between the closing quote and the delimiter is not valid RFC 4180;
+  // keep it rather than drop it.
+  const char* end = strchr(++q, delim);
+  if (!end) {
+    end = q + strlen(q);
+  }
+  if (end > q) {
+    span->tail = q;
+    span->tail_len = (size_t)(end - q);
+  }
+  return end;
 }
 
 // Function to count the number of fields in a CSV line
 static size_t get_num_fields(const char* line, char delim, char quote) {
   size_t numFields = 0;
-  int insideQuotes = 0;
+  FieldSpan span;
 
-  for (int i = 0; line[i] != '\0'; i++) {
-    if (line[i] == quote) {
-      insideQuotes = !insideQuotes;  // Toggle insideQuotes flag
-    } else if (line[i] == delim && !insideQuotes) {
-      numFields++;
+  for (const char* p = line;; p++) {
+    p = csv_scan_field(p, delim, quote, &span);
+    if (!p) {
+      return 0;
     }
-  }
 
-  // Add the last field if it is not empty
-  if (line[0] != '\0') {
     numFields++;
+    if (*p == '\0') {
+      return numFields;
+    }
   }
-  return numFields;
 }
 
-// Function to parse a CSV line and split it into fields
-static bool parse_csv_line(LineArgs* args) {
-  char field[MAX_FIELD_SIZE] = {0};
-  int insideQuotes = 0;
+// Read the first row to determine the number of fields in the CSV file,
+// then reset the file pointer to the beginning of the file.
+// Returns 0 if the file is empty or has no fields.
+static size_t csv_detect_num_fields(CsvParser* self, char* line) {
+  if (!self->stream) {
+    fprintf(stderr, "Error: CSV file already consumed\n");
+    return 0;
+  }
 
-  args->row->fields = arena_alloc(args->arena, args->num_fields * sizeof(char*));
-  if (!args->row->fields) {
-    fprintf(stderr, "ERROR: unable to allocate memory for row->fields\n");
-    return false;
+  FILE* fp = file_fp(self->stream);
+  if (!csv_read_line(self, fp, line)) {
+    return 0;
   }
+  file_seek(self->stream, 0, SEEK_SET);
+  self->offset = 0;
 
-  int fieldIndex = 0;
-  args->row->numFields = 0;
+  size_t num_fields = get_num_fields(line, self->delim, self->quote);
+  if (num_fields == 0) {
+    fprintf(stderr, "Error: no fields found in CSV file\n");
+  }
+  return num_fields;
+}
 
-  for (int i = 0; args->line[i] != '\0'; i++) {
-    if (args->line[i] == args->quote) {
-      insideQuotes = !insideQuotes;
-    } else if (args->line[i] == args->delim && !insideQuotes) {
-      field[fieldIndex] = '\0';
-      args->row->fields[args->row->numFields] = arena_alloc_string(args->arena, field);
-      if (!args->row->fields[args->row->numFields]) {
-        fprintf(stderr, "ERROR: unable to allocate memory for args->row->fields[%zu]\n", args->row->numFields);
-        return false;
+// Read the next line into line, with trailing white space trimmed.
+// Empty lines and comment lines are skipped, and so is a UTF-8 byte order mark
+// at the start of the file. Returns the length of the line, or 0 at end of file.
+static size_t csv_read_line(CsvParser* self, FILE* fp, char* line) {
+  while (fgets(line, MAX_FIELD_SIZE, fp)) {
+    // trim white space from end of line and skip empty lines
+    size_t len = strlen(line);
+    self->line_offset = self->offset;
+    self->offset += len;
+
+    if (self->line_offset == 0 && len >= 3 && memcmp(line, CSV_UTF8_BOM, 3) == 0) {
+      memmove(line, line + 3, len - 2);
+      len -= 3;
+      self->line_offset = 3;
+    }
+
+    while (len > 0 && isspace((unsigned char)line[len - 1])) {
+      len--;
+    }
+
+    if (len == 0) {
+      continue;
+    }
+
+    // Terminate the line with a null character
+    line[len] = '\0';
+
+    // skip comment lines
+    if (line[0] == self->comment) {
+      continue;
+    }
+    return len;
+  }
+  return 0;
+}
+
+// Return the index of the first byte of line that does not start a valid
+// UTF-8 sequence, or len if it is all valid. ASCII, the common case, is
+// skipped 16 bytes at a time with SSE2, or 8 at a time otherwise.
+static size_t csv_utf8_check(const char* line, size_t len) {
+  const unsigned char* p = (const unsigned char*)line;
+  size_t i = 0;
+
+  while (i < len) {
+#if defined(__SSE2__)
+    while (i + 16 <= len && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i))) == 0) {
+      i += 16;
+    }
+#endif
+    while (i + 8 <= len) {
+      uint64_t word;
+      memcpy(&word, p + i, sizeof(word));
+      if (word & 0x8080808080808080ull) {
+        break;
       }
+      i += 8;
+    }
+
+    if (i >= len) {
+      break;
+    }
+
+    if (p[i] < 0x80) {
+      i++;
+      continue;
+    }
 
-      args->row->numFields++;
-      fieldIndex = 0;
+    size_t n;
+    uint32_t cp;
+    if (p[i] >= 0xC2 && p[i] <= 0xDF) {
+      n = 2;
+      cp = p[i] & 0x1F;
+    } else if (p[i] >= 0xE0 && p[i] <= 0xEF) {
+      n = 3;
+      cp = p[i] & 0x0F;
+    } else if (p[i] >= 0xF0 && p[i] <= 0xF4) {
+      n = 4;
+      cp = p[i] & 0x07;
     } else {
-      field[fieldIndex++] = args->line[i];
+      return i;
+    }
+
+    if (n > len - i) {
+      return i;
+    }
+
+    for (size_t k = 1; k < n; k++) {
+      if ((p[i + k] & 0xC0) != 0x80) {
+        return i;
+      }
+      cp = (cp << 6) | (p[i + k] & 0x3F);
+    }
+
+    // Reject overlong forms, surrogates and code points past U+10FFFF.
+    if ((n == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF))) {
+      return i;
     }
+    i += n;
   }
+  return len;
+}
 
-  // If inside quotes at the end of the line, the line is not terminated
-  if (insideQuotes) {
-    fprintf(stderr, "ERROR: unterminated quoted field:%s in line %zu\n", args->line, args->rowIndex);
-    return false;
+// Validate (if enabled) and split the line last returned by csv_read_line into row.
+// Fields are copied to arena; with a NULL arena they are split in place in line
+// instead, into row->fields, which must already hold num_fields entries.
+// On error, *errOffset is set to the byte offset the error should be reported at.
+static CsvErrorCode csv_parse_record(CsvParser* self, Arena* arena, char* line, size_t len, size_t num_fields,
+                                     size_t rowIndex, CsvRow* row, uint64_t* errOffset) {
+  *errOffset = self->line_offset;
+
+  if (self->validate_utf8) {
+    size_t bad = csv_utf8_check(line, len);
+    if (bad < len) {
+      *errOffset = self->line_offset + bad;
+      return CSV_ERROR_INVALID_UTF8;
+    }
   }
 
-  // Add the last field.
-  field[fieldIndex] = '\0';
-  args->row->fields[args->row->numFields] = arena_alloc_string(args->arena, field);
-  if (!args->row->fields[args->row->numFields]) {
-    fprintf(stderr, "ERROR: unable to allocate memory for args->row->fields[%zu]\n", args->row->numFields);
-    return false;
+  LineArgs args = {
+    .arena = arena,
+    .line = line,
+    .in_place = arena ? NULL : line,
+    .rowIndex = rowIndex,
+    .row = row,
+    .delim = self->delim,
+    .quote = self->quote,
+    .num_fields = num_fields,
+  };
+  return parse_csv_line(&args);
+}
+
+// Copy the contents of span to dst, collapsing doubled quotes, followed by its
+// tail and a NUL. Bytes only ever move backwards, so dst may be span->start.
+// Returns the length of the field.
+static size_t csv_copy_field(char* dst, const FieldSpan* span, char quote) {
+  size_t len = span->len;
+  if (!span->escaped) {
+    memmove(dst, span->start, len);
+  } else {
+    // Rare: only quoted fields with doubled quotes take the byte-wise path.
+    len = 0;
+    for (const char* in = span->start; in < span->start + span->len; in++) {
+      dst[len++] = *in;
+      if (in[0] == quote && in[1] == quote) {
+        in++;
+      }
+    }
+  }
+
+  if (span->tail_len > 0) {
+    memmove(dst + len, span->tail, span->tail_len);
+    len += span->tail_len;
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+// Function to parse a CSV line and split it into fields.
+// Each field is copied once to the arena, with doubled quotes collapsed, so
+// row->fields always holds the final text. Without an arena, fields are cut
+// out of the line in place instead and row->fields is the caller's.
+// Returns CSV_ERROR_NONE on success. Never writes to stderr: callers decide
+// whether and how to report the error.
+static CsvErrorCode parse_csv_line(LineArgs* args) {
+  CsvRow* row = args->row;
+  if (args->arena) {
+    row->fields = arena_alloc(args->arena, args->num_fields * sizeof(char*));
+    if (!row->fields) {
+      return CSV_ERROR_ALLOC;
+    }
+  }
+
+  row->numFields = 0;
+
+  FieldSpan span;
+  for (const char* p = args->line;; p++) {
+    p = csv_scan_field(p, args->delim, args->quote, &span);
+    if (!p) {
+      return CSV_ERROR_UNTERMINATED_QUOTE;
+    }
+
+    // Too many fields: stop before overrunning row->fields.
+    if (row->numFields == args->num_fields) {
+      return CSV_ERROR_FIELD_COUNT;
+    }
+
+    // Checked first: splitting in place overwrites the delimiter.
+    bool last = *p == '\0';
+
+    char* field;
+    if (args->arena) {
+      field = arena_alloc(args->arena, span.len + span.tail_len + 1);
+      if (!field) {
+        return CSV_ERROR_ALLOC;
+      }
+    } else {
+      field = args->in_place + (span.start - args->line);
+    }
+    csv_copy_field(field, &span, args->quote);
+
+    row->fields[row->numFields++] = field;
+    if (last) {
+      break;
+    }
   }
-  args->row->numFields++;
 
   // validate the number of fields
-  if (args->row->numFields != args->num_fields) {
-    fprintf(stderr, "ERROR: invalid number of fields in line %zu\n", args->rowIndex);
-    return false;
+  if (row->numFields != args->num_fields) {
+    return CSV_ERROR_FIELD_COUNT;
   }
 
-  return true;
+  return CSV_ERROR_NONE;
 }
 
-// count the number of lines in a csv file.
-// ignore comments. Optionally skip header.
-static size_t line_count(CsvParser* self) {
-  size_t lines = 0;
-  char prevChar = '\n';
-  bool headerSkipped = false;
+const char* csvrow_field(const CsvRow* row, size_t index) {
+  if (index >= row->numFields) {
+    return NULL;
+  }
+  return row->fields[index];
+}
 
-  FILE* fp = file_fp(self->stream);
-  while (!feof(fp)) {
-    char c = fgetc(fp);
-    if (c == EOF) {
-      break;
+// Record an error for row rowIndex at byte offset in the file.
+// In strict mode it is also printed, since parsing stops there.
+static void csv_report_error(CsvParser* self, CsvErrorCode code, size_t rowIndex, uint64_t offset) {
+  if (!self->lenient) {
+    fprintf(stderr, "ERROR: %s in line %zu\n", csvparser_strerror(code), rowIndex);
+  }
+
+  if (self->num_errors == self->cap_errors) {
+    size_t cap = self->cap_errors ? self->cap_errors * 2 : 64;
+    CsvError* errors = realloc(self->errors, cap * sizeof(CsvError));
+    if (!errors) {
+      return;  // Keep parsing; the list is best effort.
     }
+    self->errors = errors;
+    self->cap_errors = cap;
+  }
 
-    // Ignore comment lines
-    if (c == self->comment) {
-      while ((c = fgetc(fp)) != EOF && c != '\n')
-        ;
+  self->errors[self->num_errors++] = (CsvError){.row = rowIndex, .offset = offset, .code = code};
+}
 
-      // read the new line character at end of comment line
-      c = fgetc(fp);
-      continue;
+// count the number of rows in a csv file, the same way the parser reads them.
+static size_t line_count(CsvParser* self) {
+  size_t len = 0;
+  char* data = self->stream ? csv_map_stream(file_fp(self->stream), &len) : NULL;
+  if (!data) {
+    return 0;
+  }
+
+  size_t lines = csv_count_records(data, len, self->comment, 0);
+  csv_unmap_file(data, len);
+
+  // Skip the header line if it exists
+  if (lines > 0 && self->has_header && self->skip_header) {
+    lines--;
+  }
+  return lines;
+}
+
+// ================ Row counting ================
+//
+// Records end at '\n': quotes never span lines in this parser (a quoted field
+// still open at the end of a line is an invalid row), so a newline is always a
+// record terminator and the counter need not track quotes. Each read of
+// csv_read_line is a row when it is not blank and does not start with the
+// comment character. Lines longer than MAX_FIELD_SIZE - 1 bytes take several
+// reads, and are counted as several rows, exactly as the parser sees them.
+
+// Files smaller than this per thread are not worth splitting.
+#define CSV_COUNT_MIN_CHUNK (1 << 20)
+
+typedef struct CountChunk {
+  const char* data;  // Whole file
+  size_t len;        // Length of the whole file
+  size_t start;      // First byte of the chunk
+  size_t end;        // One past the last byte of the chunk
+  char comment;
+  size_t count;  // Result: rows starting inside the chunk
+} CountChunk;
+
+// Whether data[start, end), one read of csv_read_line, is a row. A byte order
+// mark at the start of the file is skipped, as csv_read_line does.
+static bool csv_count_is_row(const char* data, size_t start, size_t end, char comment) {
+  if (start == 0 && end >= 3 && memcmp(data, CSV_UTF8_BOM, 3) == 0) {
+    start = 3;
+  }
+
+  // Usually the first byte decides; only blank-looking lines are scanned.
+  for (size_t i = start; i < end; i++) {
+    if (!isspace((unsigned char)data[i])) {
+      return data[start] != comment;
     }
+  }
+  return false;
+}
 
-    // Skip the header line if it exists and hasn't been skipped yet
-    if (self->has_header && self->skip_header && !headerSkipped && lines == 0) {
-      while ((c = fgetc(fp)) != EOF && c != '\n')
-        ;
-      headerSkipped = true;
-      continue;
+// Count the rows whose first byte lies in [start, end).
+static size_t csv_count_chunk(const char* data, size_t len, size_t start, size_t end, char comment) {
+  size_t count = 0;
+  size_t pos = start;
+
+  // A line belongs to the chunk its first byte lands in.
+  if (pos > 0 && data[pos - 1] != '\n') {
+    const char* nl = memchr(data + pos, '\n', len - pos);
+    pos = nl ? (size_t)(nl - data) + 1 : len;
+  }
+
+  while (pos < end) {
+    // memchr is vectorized in every libc worth using.
+    const char* nl = memchr(data + pos, '\n', len - pos);
+    size_t line_end = nl ? (size_t)(nl - data) + 1 : len;
+
+    // fgets reads at most MAX_FIELD_SIZE - 1 bytes at a time.
+    for (size_t read = pos; read < line_end; read += MAX_FIELD_SIZE - 1) {
+      size_t read_end = line_end - read > MAX_FIELD_SIZE - 1 ? read + MAX_FIELD_SIZE - 1 : line_end;
+      count += csv_count_is_row(data, read, read_end, comment);
     }
+    pos = line_end;
+  }
+  return count;
+}
 
-    if (c == '\n' && !isspace(prevChar)) {
-      char nextChar = fgetc(fp);
-      if (nextChar == EOF) {
-        break;
+#ifndef _WIN32
+static void* csv_count_worker(void* arg) {
+  CountChunk* chunk = arg;
+  chunk->count = csv_count_chunk(chunk->data, chunk->len, chunk->start, chunk->end, chunk->comment);
+  return NULL;
+}
+#endif
+
+// Count the rows in data, including the header, with up to nthreads threads.
+// nthreads of 0 uses one thread per online CPU.
+static size_t csv_count_records(const char* data, size_t len, char comment, size_t nthreads) {
+#ifndef _WIN32
+  if (nthreads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus > 0 ? (size_t)cpus : 1;
+  }
+
+  if (nthreads > len / CSV_COUNT_MIN_CHUNK) {
+    nthreads = len / CSV_COUNT_MIN_CHUNK;
+  }
+
+  if (nthreads > 1) {
+    CountChunk* chunks = calloc(nthreads, sizeof(CountChunk));
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    bool* started = calloc(nthreads, sizeof(bool));
+
+    if (chunks && threads && started) {
+      for (size_t i = 0; i < nthreads; i++) {
+        chunks[i] = (CountChunk){
+          .data = data,
+          .len = len,
+          .start = len / nthreads * i,
+          .end = i + 1 == nthreads ? len : len / nthreads * (i + 1),
+          .comment = comment,
+        };
+
+        // Count on this thread whatever a thread could not be started for.
+        started[i] = pthread_create(&threads[i], NULL, csv_count_worker, &chunks[i]) == 0;
+        if (!started[i]) {
+          csv_count_worker(&chunks[i]);
+        }
       }
 
-      if (isspace(nextChar)) {
-        continue;
+      size_t count = 0;
+      for (size_t i = 0; i < nthreads; i++) {
+        if (started[i]) {
+          pthread_join(threads[i], NULL);
+        }
+        count += chunks[i].count;
       }
-      lines++;
 
-      // Put back the character if it is not EOF
-      ungetc(nextChar, fp);
-    } else if (!isspace(c)) {
-      prevChar = c;
+      free(chunks);
+      free(threads);
+      free(started);
+      return count;
     }
+
+    free(chunks);
+    free(threads);
+    free(started);
+  }
+#else
+  (void)nthreads;
+#endif
+
+  return csv_count_chunk(data, len, 0, len, comment);
+}
+
+size_t csvparser_count_rows(const char* filename, const CsvConfig* config, size_t nthreads) {
+  CsvConfig defaults = {.comment = '#', .has_header = true, .skip_header = true};
+  if (!config) {
+    config = &defaults;
   }
 
-  // Count last line if it doesn't end with a newline character and is not empty
-  if (prevChar != '\n' && !isspace(prevChar)) {
-    lines++;
+  size_t len = 0;
+  char* data = csv_map_file(filename, &len);
+  if (!data) {
+    return 0;
   }
 
-  file_seek(self->stream, 0, SEEK_SET);
-  return lines;
-}
\ No newline at end of file
+  size_t rows = csv_count_records(data, len, config->comment ? config->comment : '#', nthreads);
+  csv_unmap_file(data, len);
+
+  if (rows > 0 && config->has_header && config->skip_header) {
+    rows--;
+  }
+  return rows;
+}
+
+// ================ Columnar snapshot cache ================
+//
+// Layout (native endianness):
+//   CsvCacheHeader
+//   uint64_t offsets[num_fields][num_rows]  offsets into the string heap, column-major
+//   char heap[heap_size]                    NUL-terminated strings, column by column
+//   CsvCacheError errors[num_errors]        errors recorded by the parse, unaligned
+//
+// CSV_CACHE_VERSION must be bumped whenever the layout changes or the parser
+// produces different fields for the same input, so that stale snapshots are
+// parsed again:
+//   2: a leading UTF-8 byte order mark is stripped
+//   3: quoted fields follow RFC 4180
+//   4: parse errors are stored after the heap
+//   5: the device and inode of the source file are recorded
+#define CSV_CACHE_MAGIC   "CSVCACHE"
+#define CSV_CACHE_VERSION 5u
+
+typedef struct CsvCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_fields;
+  uint64_t num_rows;
+  uint64_t heap_size;
+  uint64_t num_errors;
+  uint64_t src_size;
+  uint64_t src_dev;  // Identify the source file, not just its size and mtime
+  uint64_t src_ino;
+  int64_t src_mtime;
+  int64_t src_mtime_nsec;
+  char delim;
+  char quote;
+  char comment;
+  uint8_t has_header;
+  uint8_t skip_header;
+  uint8_t lenient;
+  uint8_t validate_utf8;
+  uint8_t reserved[1];
+} CsvCacheHeader;
+
+typedef struct CsvCacheError {
+  uint64_t row;
+  uint64_t offset;
+  uint32_t code;
+  uint32_t reserved;
+} CsvCacheError;
+
+// Map the whole file behind fp copy-on-write so fields can be handed out as char*.
+// The mapping stays valid after fp is closed. Returns NULL on failure or for empty files.
+static void* csv_map_stream(FILE* fp, size_t* len) {
+  struct stat st;
+  if (fstat(fileno(fp), &st) == -1 || st.st_size <= 0) {
+    return NULL;
+  }
+
+#ifndef _WIN32
+  void* addr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+#else
+  long pos = ftell(fp);
+  void* addr = malloc((size_t)st.st_size);
+  if (addr && (fseek(fp, 0, SEEK_SET) != 0 || fread(addr, 1, (size_t)st.st_size, fp) != (size_t)st.st_size)) {
+    free(addr);
+    addr = NULL;
+  }
+  fseek(fp, pos, SEEK_SET);
+  if (!addr) {
+    return NULL;
+  }
+#endif
+
+  *len = (size_t)st.st_size;
+  return addr;
+}
+
+static void* csv_map_file(const char* path, size_t* len) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  void* addr = csv_map_stream(fp, len);
+  fclose(fp);
+  return addr;
+}
+
+static void csv_unmap_file(void* addr, size_t len) {
+#ifndef _WIN32
+  munmap(addr, len);
+#else
+  (void)len;
+  free(addr);
+#endif
+}
+
+// Build the snapshot path: <filename>.csvcache, or <cache_dir>/<basename>.<hash>.csvcache
+// where hash is that of the absolute path of filename, so that files with the
+// same name in different directories do not share a snapshot.
+static char* csv_cache_path(const char* filename, const char* cache_dir) {
+  if (!cache_dir) {
+    size_t len = strlen(filename) + sizeof(".csvcache");
+    char* path = malloc(len);
+    if (path) {
+      snprintf(path, len, "%s.csvcache", filename);
+    }
+    return path;
+  }
+
+  const char* base = filename;
+  for (const char* p = filename; *p; p++) {
+    if (*p == '/' || *p == '\\') {
+      base = p + 1;
+    }
+  }
+
+#ifndef _WIN32
+  char* abs_path = realpath(filename, NULL);
+#else
+  char* abs_path = _fullpath(NULL, filename, 0);
+#endif
+  uint64_t hash = csv_hash_key(abs_path ? abs_path : filename);
+  free(abs_path);
+
+  size_t len = strlen(cache_dir) + 1 + strlen(base) + 1 + 16 + sizeof(".csvcache");
+  char* path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%s.%016llx.csvcache", cache_dir, base, (unsigned long long)hash);
+  }
+  return path;
+}
+
+static void csv_cache_fill_header(const CsvParser* self, const struct stat* st, CsvCacheHeader* hdr) {
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, CSV_CACHE_MAGIC, sizeof(hdr->magic));
+  hdr->version = CSV_CACHE_VERSION;
+  hdr->src_size = (uint64_t)st->st_size;
+  hdr->src_dev = (uint64_t)st->st_dev;
+  hdr->src_ino = (uint64_t)st->st_ino;
+  hdr->src_mtime = (int64_t)st->st_mtime;
+#if defined(__linux__)
+  hdr->src_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+#endif
+  hdr->delim = self->delim;
+  hdr->quote = self->quote;
+  hdr->comment = self->comment;
+  hdr->has_header = self->has_header;
+  hdr->skip_header = self->skip_header;
+  hdr->lenient = self->lenient;
+  hdr->validate_utf8 = self->validate_utf8;
+}
+
+// Load rows from a snapshot if it matches the source file and dialect.
+static bool csv_cache_load(CsvParser* self, const char* cache_path, const struct stat* st) {
+  size_t len = 0;
+  char* map = csv_map_file(cache_path, &len);
+  if (!map) {
+    return false;
+  }
+
+  CsvCacheHeader expected;
+  csv_cache_fill_header(self, st, &expected);
+
+  const CsvCacheHeader* hdr = (const CsvCacheHeader*)map;
+  if (len < sizeof(*hdr) || memcmp(hdr->magic, expected.magic, sizeof(hdr->magic)) != 0 ||
+      hdr->version != expected.version || hdr->src_size != expected.src_size || hdr->src_dev != expected.src_dev ||
+      hdr->src_ino != expected.src_ino ||
+      hdr->src_mtime != expected.src_mtime || hdr->src_mtime_nsec != expected.src_mtime_nsec ||
+      hdr->delim != expected.delim || hdr->quote != expected.quote || hdr->comment != expected.comment ||
+      hdr->has_header != expected.has_header || hdr->skip_header != expected.skip_header ||
+      hdr->lenient != expected.lenient || hdr->validate_utf8 != expected.validate_utf8) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  size_t num_rows = (size_t)hdr->num_rows;
+  size_t num_fields = hdr->num_fields;
+  size_t num_offsets = num_rows * num_fields;
+  // Rows without fields are never written, so their count is not bounded by the file size.
+  if ((num_fields == 0 && num_rows != 0) || (num_fields != 0 && num_offsets / num_fields != num_rows)) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  size_t body = len - sizeof(*hdr);
+  size_t num_errors = (size_t)hdr->num_errors;
+  if (num_offsets > body / sizeof(uint64_t) || num_errors > body / sizeof(CsvCacheError) ||
+      body - num_offsets * sizeof(uint64_t) < num_errors * sizeof(CsvCacheError) ||
+      body - num_offsets * sizeof(uint64_t) - num_errors * sizeof(CsvCacheError) != hdr->heap_size) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  const uint64_t* offsets = (const uint64_t*)(map + sizeof(*hdr));
+  char* heap = map + sizeof(*hdr) + num_offsets * sizeof(uint64_t);
+  size_t heap_size = (size_t)hdr->heap_size;
+
+  // Every offset must land inside a NUL-terminated heap.
+  if (num_offsets > 0 && (heap_size == 0 || heap[heap_size - 1] != '\0')) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  CsvRow** rows = csv_allocate_rows(self->arena, num_rows);
+  char** fields = arena_alloc(self->arena, (num_offsets ? num_offsets : 1) * sizeof(char*));
+  if ((num_rows && !rows) || !fields) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  for (size_t r = 0; r < num_rows; r++) {
+    rows[r]->fields = fields + r * num_fields;
+    rows[r]->numFields = num_fields;
+  }
+
+  for (size_t c = 0; c < num_fields; c++) {
+    const uint64_t* column = offsets + c * num_rows;
+    for (size_t r = 0; r < num_rows; r++) {
+      if (column[r] >= heap_size) {
+        csv_unmap_file(map, len);
+        return false;
+      }
+      rows[r]->fields[c] = heap + column[r];
+    }
+  }
+
+  // Restore the errors, so that a cached lenient parse reports what the original did.
+  CsvError* errors = num_errors > 0 ? malloc(num_errors * sizeof(CsvError)) : NULL;
+  if (num_errors > 0 && !errors) {
+    csv_unmap_file(map, len);
+    return false;
+  }
+
+  const char* error_data = heap + heap_size;
+  for (size_t i = 0; i < num_errors; i++) {
+    CsvCacheError rec;
+    memcpy(&rec, error_data + i * sizeof(rec), sizeof(rec));
+    errors[i] = (CsvError){.row = (size_t)rec.row, .offset = rec.offset, .code = (CsvErrorCode)rec.code};
+  }
+
+  free(self->errors);
+  self->errors = errors;
+  self->num_errors = num_errors;
+  self->cap_errors = num_errors;
+
+  self->rows = rows;
+  self->num_rows = num_rows;
+  self->cache_map = map;
+  self->cache_len = len;
+  return true;
+}
+
+// Write the parsed rows as a snapshot. Written to a temporary file and renamed
+// into place so that concurrent readers never see a partial snapshot.
+static bool csv_cache_store(const CsvParser* self, const char* cache_path, const struct stat* st) {
+  size_t num_rows = self->num_rows;
+  size_t num_fields = num_rows > 0 ? self->rows[0]->numFields : 0;
+
+  size_t tmp_len = strlen(cache_path) + sizeof(".tmp");
+  char* tmp_path = malloc(tmp_len);
+  if (!tmp_path) {
+    return false;
+  }
+  snprintf(tmp_path, tmp_len, "%s.tmp", cache_path);
+
+  FILE* fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    free(tmp_path);
+    return false;
+  }
+
+  CsvCacheHeader hdr;
+  csv_cache_fill_header(self, st, &hdr);
+  hdr.num_rows = num_rows;
+  hdr.num_fields = (uint32_t)num_fields;
+  hdr.num_errors = self->num_errors;
+
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+  uint64_t offset = 0;
+  for (size_t c = 0; c < num_fields && ok; c++) {
+    for (size_t r = 0; r < num_rows && ok; r++) {
+      ok = fwrite(&offset, sizeof(offset), 1, fp) == 1;
+      offset += strlen(csvrow_field(self->rows[r], c)) + 1;
+    }
+  }
+
+  for (size_t c = 0; c < num_fields && ok; c++) {
+    for (size_t r = 0; r < num_rows && ok; r++) {
+      const char* field = csvrow_field(self->rows[r], c);
+      ok = fwrite(field, 1, strlen(field) + 1, fp) == strlen(field) + 1;
+    }
+  }
+
+  for (size_t i = 0; i < self->num_errors && ok; i++) {
+    const CsvError* err = &self->errors[i];
+    CsvCacheError rec = {.row = err->row, .offset = err->offset, .code = (uint32_t)err->code};
+    ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+  }
+
+  // Patch in the heap size now that it is known.
+  hdr.heap_size = offset;
+  if (ok) {
+    ok = fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+  }
+
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) {
+    remove(cache_path);  // rename() does not replace existing files on Windows.
+    ok = rename(tmp_path, cache_path) == 0;
+  }
+
+  if (!ok) {
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  return ok;
+}
+
+CsvParser* csvparser_open_cached(const char* filename, const CsvConfig* config, const char* cache_dir) {
+  struct stat st;
+  if (stat(filename, &st) == -1) {
+    fprintf(stderr, "error reading file status %s\n", filename);
+    return NULL;
+  }
+
+  CsvParser* parser = csvparser_new(filename);
+  if (!parser) {
+    return NULL;
+  }
+
+  if (config) {
+    csvparser_setconfig(parser, *config);
+  }
+
+  char* cache_path = csv_cache_path(filename, cache_dir);
+  if (!cache_path) {
+    fprintf(stderr, "error allocating memory for cache path\n");
+    csvparser_free(parser);
+    return NULL;
+  }
+
+  if (csv_cache_load(parser, cache_path, &st)) {
+    csv_close_stream(parser);
+    free(cache_path);
+    return parser;
+  }
+
+  if (!csvparser_parse(parser)) {
+    free(cache_path);
+    csvparser_free(parser);
+    return NULL;
+  }
+
+  // A failed write only costs the next caller a re-parse.
+  if (!csv_cache_store(parser, cache_path, &st)) {
+    fprintf(stderr, "warning: unable to write csv cache %s\n", cache_path);
+  }
+
+  free(cache_path);
+  return parser;
+}
+
+
+// ================ External sort ================
+//
+// Rows are parsed into an arena until the memory budget is used up, sorted and
+// spilled to a temporary file as a run. Runs are merged while spilling, like
+// carries in a counter: as soon as the last CSV_SORT_MAX_FANIN runs have gone
+// through the same number of merges (their level), they are merged into one run
+// of the next level. At most CSV_SORT_MAX_FANIN - 1 runs per level stay open,
+// so the number of open files grows with the logarithm of the input size.
+// What is left is merged CSV_SORT_MAX_FANIN at a time until a single merge can
+// write the output.
+//
+// Spilled rows are stored as: uint32_t num_fields, uint32_t num_bytes,
+// followed by num_fields NUL-terminated strings (num_bytes in total).
+#define CSV_SORT_MAX_FANIN 64
+
+typedef struct SortKey {
+  const char* str;  // Key field
+  double num;       // Numeric value of the key, if is_num
+  bool is_num;      // Whether the whole field parses as a number
+} SortKey;
+
+typedef struct SortItem {
+  CsvRow* row;
+  SortKey* keys;
+  size_t num_keys;
+  size_t seq;  // Input order, keeps the sort stable
+} SortItem;
+
+typedef struct SortRun {
+  FILE* fp;
+  size_t index;  // Run order, keeps the merge stable
+  CsvRow row;
+  SortKey* keys;
+  char* buf;
+  size_t cap;
+} SortRun;
+
+static void csv_sort_keys(CsvRow* row, const size_t* key_cols, size_t num_keys, SortKey* keys) {
+  for (size_t k = 0; k < num_keys; k++) {
+    char* end;
+    const char* str = csvrow_field(row, key_cols[k]);
+    keys[k].str = str;
+    keys[k].num = strtod(str, &end);
+    // NaN would break the ordering, compare it as text.
+    keys[k].is_num = end != str && *end == '\0' && keys[k].num == keys[k].num;
+  }
+}
+
+// Numbers compare numerically and sort before text; text compares bytewise.
+static int csv_compare_keys(const SortKey* a, const SortKey* b, size_t num_keys) {
+  for (size_t k = 0; k < num_keys; k++) {
+    if (a[k].is_num && b[k].is_num) {
+      if (a[k].num != b[k].num) {
+        return a[k].num < b[k].num ? -1 : 1;
+      }
+    } else if (a[k].is_num != b[k].is_num) {
+      return a[k].is_num ? -1 : 1;
+    } else {
+      int cmp = strcmp(a[k].str, b[k].str);
+      if (cmp != 0) {
+        return cmp;
+      }
+    }
+  }
+  return 0;
+}
+
+static int csv_compare_items(const void* a, const void* b) {
+  const SortItem* x = a;
+  const SortItem* y = b;
+
+  int cmp = csv_compare_keys(x->keys, y->keys, x->num_keys);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// Write row as a CSV record. Fields containing the delimiter, the quote
+// character or a line break are quoted, with embedded quotes doubled.
+static bool csv_write_row(FILE* fp, CsvRow* row, char delim, char quote) {
+  for (size_t i = 0; i < row->numFields; i++) {
+    const char* field = csvrow_field(row, i);
+    if (i > 0) {
+      fputc(delim, fp);
+    }
+
+    if (strpbrk(field, (char[]){delim, quote, '\n', '\r', '\0'}) == NULL) {
+      fputs(field, fp);
+      continue;
+    }
+
+    fputc(quote, fp);
+    for (const char* p = field; *p; p++) {
+      if (*p == quote) {
+        fputc(quote, fp);
+      }
+      fputc(*p, fp);
+    }
+    fputc(quote, fp);
+  }
+
+  fputc('\n', fp);
+  return !ferror(fp);
+}
+
+static bool csv_spill_row(FILE* fp, CsvRow* row) {
+  uint32_t header[2] = {(uint32_t)row->numFields, 0};
+  for (size_t i = 0; i < row->numFields; i++) {
+    header[1] += (uint32_t)strlen(csvrow_field(row, i)) + 1;
+  }
+
+  if (fwrite(header, sizeof(header), 1, fp) != 1) {
+    return false;
+  }
+
+  for (size_t i = 0; i < row->numFields; i++) {
+    size_t len = strlen(row->fields[i]) + 1;
+    if (fwrite(row->fields[i], 1, len, fp) != len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sort items and spill them to a new temporary file, rewound for reading.
+static FILE* csv_spill_run(SortItem* items, size_t num_items) {
+  qsort(items, num_items, sizeof(SortItem), csv_compare_items);
+
+  FILE* fp = tmpfile();
+  if (!fp) {
+    fprintf(stderr, "csv_spill_run(): error creating temporary file\n");
+    return NULL;
+  }
+
+  for (size_t i = 0; i < num_items; i++) {
+    if (!csv_spill_row(fp, items[i].row)) {
+      fprintf(stderr, "csv_spill_run(): error writing temporary file\n");
+      fclose(fp);
+      return NULL;
+    }
+  }
+
+  rewind(fp);
+  return fp;
+}
+
+// Read the next row of a run into its cursor. Returns false at the end of the run.
+static bool csv_run_next(SortRun* run, const size_t* key_cols, size_t num_keys) {
+  uint32_t header[2];
+  if (fread(header, sizeof(header), 1, run->fp) != 1 || header[0] != run->row.numFields) {
+    return false;
+  }
+
+  if (header[1] > run->cap) {
+    char* buf = realloc(run->buf, header[1]);
+    if (!buf) {
+      return false;
+    }
+    run->buf = buf;
+    run->cap = header[1];
+  }
+
+  if (header[1] == 0 || fread(run->buf, 1, header[1], run->fp) != header[1] || run->buf[header[1] - 1] != '\0') {
+    return false;
+  }
+
+  char* p = run->buf;
+  char* end = run->buf + header[1];
+  for (size_t i = 0; i < run->row.numFields; i++) {
+    if (p >= end) {
+      return false;
+    }
+    run->row.fields[i] = p;
+    p += strlen(p) + 1;
+  }
+
+  csv_sort_keys(&run->row, key_cols, num_keys, run->keys);
+  return true;
+}
+
+static bool csv_run_less(const SortRun* a, const SortRun* b, size_t num_keys) {
+  int cmp = csv_compare_keys(a->keys, b->keys, num_keys);
+  return cmp < 0 || (cmp == 0 && a->index < b->index);
+}
+
+static void csv_heap_sift_down(SortRun** heap, size_t size, size_t i, size_t num_keys) {
+  for (;;) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+
+    if (left < size && csv_run_less(heap[left], heap[smallest], num_keys)) {
+      smallest = left;
+    }
+    if (right < size && csv_run_less(heap[right], heap[smallest], num_keys)) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+
+    SortRun* tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+// K-way merge of sorted runs into out. Rows are written as CSV when
+// self is given, otherwise in the spill format for another merge pass.
+static bool csv_merge_runs(FILE** files, size_t num_files, FILE* out, const CsvParser* self, const size_t* key_cols,
+                           size_t num_keys, size_t num_fields) {
+  SortRun* runs = calloc(num_files, sizeof(SortRun));
+  SortRun** heap = malloc(num_files * sizeof(SortRun*));
+  char** fields = malloc(num_files * num_fields * sizeof(char*));
+  SortKey* keys = malloc(num_files * num_keys * sizeof(SortKey));
+  bool ok = runs && heap && fields && keys;
+
+  size_t size = 0;
+  for (size_t i = 0; i < num_files && ok; i++) {
+    runs[i].fp = files[i];
+    runs[i].index = i;
+    runs[i].row.fields = fields + i * num_fields;
+    runs[i].row.numFields = num_fields;
+    runs[i].keys = keys + i * num_keys;
+    if (csv_run_next(&runs[i], key_cols, num_keys)) {
+      heap[size++] = &runs[i];
+    } else {
+      ok = !ferror(files[i]) && feof(files[i]);
+    }
+  }
+
+  for (size_t i = size / 2; i-- > 0;) {
+    csv_heap_sift_down(heap, size, i, num_keys);
+  }
+
+  while (ok && size > 0) {
+    SortRun* top = heap[0];
+    ok = self ? csv_write_row(out, &top->row, self->delim, self->quote) : csv_spill_row(out, &top->row);
+
+    if (!csv_run_next(top, key_cols, num_keys)) {
+      // A run must end exactly at a row boundary.
+      ok = ok && !ferror(top->fp) && feof(top->fp);
+      heap[0] = heap[--size];
+    }
+    csv_heap_sift_down(heap, size, 0, num_keys);
+  }
+
+  if (runs) {
+    for (size_t i = 0; i < num_files; i++) {
+      free(runs[i].buf);
+    }
+  }
+
+  free(runs);
+  free(heap);
+  free(fields);
+  free(keys);
+  return ok;
+}
+
+// Merge spilled runs down to a single pass and write them to out as CSV.
+// All files are closed.
+static bool csv_merge_all(FILE** runs, size_t num_runs, FILE* out, const CsvParser* self, const size_t* key_cols,
+                          size_t num_keys, size_t num_fields) {
+  bool ok = true;
+
+  while (ok && num_runs > CSV_SORT_MAX_FANIN) {
+    size_t merged = 0;
+    for (size_t i = 0; i < num_runs; i += CSV_SORT_MAX_FANIN) {
+      size_t n = num_runs - i < CSV_SORT_MAX_FANIN ? num_runs - i : CSV_SORT_MAX_FANIN;
+
+      FILE* dst = ok ? tmpfile() : NULL;
+      ok = ok && dst && csv_merge_runs(runs + i, n, dst, NULL, key_cols, num_keys, num_fields);
+      for (size_t j = i; j < i + n; j++) {
+        fclose(runs[j]);
+      }
+
+      if (dst) {
+        rewind(dst);
+        runs[merged++] = dst;
+      }
+    }
+    num_runs = merged;
+  }
+
+  ok = ok && csv_merge_runs(runs, num_runs, out, self, key_cols, num_keys, num_fields);
+  for (size_t i = 0; i < num_runs; i++) {
+    fclose(runs[i]);
+  }
+  return ok;
+}
+
+// Spilled runs waiting to be merged, in input order, which keeps the merges stable.
+typedef struct RunStack {
+  FILE** files;
+  size_t* levels;  // Number of merges each run went through
+  size_t count;
+  size_t cap;
+} RunStack;
+
+// Push a freshly spilled run, then merge the last CSV_SORT_MAX_FANIN runs for as
+// long as they share a level. On failure the run is closed.
+static bool csv_push_run(RunStack* stack, FILE* run, const size_t* key_cols, size_t num_keys, size_t num_fields) {
+  if (stack->count == stack->cap) {
+    size_t cap = stack->cap ? stack->cap * 2 : CSV_SORT_MAX_FANIN;
+    FILE** files = realloc(stack->files, cap * sizeof(FILE*));
+    if (files) {
+      stack->files = files;
+    }
+    size_t* levels = files ? realloc(stack->levels, cap * sizeof(size_t)) : NULL;
+    if (!levels) {
+      fclose(run);
+      return false;
+    }
+    stack->levels = levels;
+    stack->cap = cap;
+  }
+
+  stack->files[stack->count] = run;
+  stack->levels[stack->count] = 0;
+  stack->count++;
+
+  // Levels never increase towards the top, so the ends of the window decide.
+  while (stack->count >= CSV_SORT_MAX_FANIN &&
+         stack->levels[stack->count - CSV_SORT_MAX_FANIN] == stack->levels[stack->count - 1]) {
+    size_t first = stack->count - CSV_SORT_MAX_FANIN;
+    FILE* dst = tmpfile();
+    bool ok = dst && csv_merge_runs(stack->files + first, CSV_SORT_MAX_FANIN, dst, NULL, key_cols, num_keys,
+                                    num_fields);
+    if (!ok) {
+      fprintf(stderr, "csv_push_run(): error merging runs\n");
+      if (dst) {
+        fclose(dst);
+      }
+      return false;
+    }
+
+    for (size_t i = first; i < stack->count; i++) {
+      fclose(stack->files[i]);
+    }
+    rewind(dst);
+    stack->files[first] = dst;
+    stack->levels[first]++;
+    stack->count = first + 1;
+  }
+  return true;
+}
+
+bool csvparser_sort_to_file(CsvParser* self, const size_t* key_cols, size_t num_keys, const char* output,
+                            size_t mem_limit) {
+  if (!key_cols || num_keys == 0 || !output) {
+    fprintf(stderr, "csvparser_sort_to_file(): no sort keys or output file given\n");
+    csv_close_stream(self);
+    return false;
+  }
+
+  if (mem_limit == 0) {
+    mem_limit = CSV_SORT_DEFAULT_MEM_LIMIT;
+  }
+
+  char line[MAX_FIELD_SIZE] = {0};
+  size_t num_fields = csv_detect_num_fields(self, line);
+  if (num_fields == 0) {
+    csv_close_stream(self);
+    return false;
+  }
+
+  for (size_t k = 0; k < num_keys; k++) {
+    if (key_cols[k] >= num_fields) {
+      fprintf(stderr, "csvparser_sort_to_file(): key column %zu out of range\n", key_cols[k]);
+      csv_close_stream(self);
+      return false;
+    }
+  }
+
+  FILE* out = fopen(output, "w");
+  if (!out) {
+    fprintf(stderr, "error opening file %s\n", output);
+    csv_close_stream(self);
+    return false;
+  }
+
+  Arena* run_arena = arena_create(CSV_ARENA_BLOCK_SIZE, ARENA_DEFAULT_ALIGNMENT);
+  RunStack runs = {0};
+  SortItem* items = NULL;
+  size_t num_items = 0;
+  size_t cap_items = 0;
+  size_t run_bytes = 0;
+  size_t rowIndex = 0;     // Valid rows, the stable sort sequence
+  size_t recordIndex = 0;  // Data rows, valid or not, for error reports
+  bool headerDone = !self->has_header;
+  bool ok = run_arena != NULL;
+  FILE* fp = file_fp(self->stream);
+
+  size_t len;
+  while (ok && (len = csv_read_line(self, fp, line)) > 0) {
+    // The header stays on top of the output and outlives the runs.
+    Arena* arena = headerDone ? run_arena : self->arena;
+    CsvRow* row = arena_alloc(arena, sizeof(CsvRow));
+    if (!row) {
+      ok = false;
+      break;
+    }
+
+    uint64_t errOffset;
+    CsvErrorCode err = csv_parse_record(self, arena, line, len, num_fields, recordIndex, row, &errOffset);
+    if (headerDone) {
+      recordIndex++;
+    }
+    if (err != CSV_ERROR_NONE) {
+      csv_report_error(self, err, headerDone ? recordIndex - 1 : 0, errOffset);
+      if (self->lenient && headerDone) {
+        continue;
+      }
+      ok = false;
+      break;
+    }
+
+    if (!headerDone) {
+      headerDone = true;
+      ok = csv_write_row(out, row, self->delim, self->quote);
+      continue;
+    }
+
+    SortKey* keys = arena_alloc(run_arena, num_keys * sizeof(SortKey));
+    if (!keys) {
+      ok = false;
+      break;
+    }
+    csv_sort_keys(row, key_cols, num_keys, keys);
+
+    if (num_items == cap_items) {
+      size_t cap = cap_items ? cap_items * 2 : 1024;
+      SortItem* grown = realloc(items, cap * sizeof(SortItem));
+      if (!grown) {
+        ok = false;
+        break;
+      }
+      items = grown;
+      cap_items = cap;
+    }
+
+    items[num_items++] = (SortItem){.row = row, .keys = keys, .num_keys = num_keys, .seq = rowIndex++};
+    run_bytes += strlen(line) + 1 + sizeof(CsvRow) + num_fields * sizeof(char*) + num_keys * sizeof(SortKey) +
+                 sizeof(SortItem);
+
+    if (run_bytes >= mem_limit) {
+      FILE* run = csv_spill_run(items, num_items);
+      if (!run || !csv_push_run(&runs, run, key_cols, num_keys, num_fields)) {
+        ok = false;
+        break;
+      }
+
+      // Start the next run with an empty arena.
+      arena_destroy(run_arena);
+      run_arena = arena_create(CSV_ARENA_BLOCK_SIZE, ARENA_DEFAULT_ALIGNMENT);
+      ok = run_arena != NULL;
+      num_items = 0;
+      run_bytes = 0;
+    }
+  }
+
+  if (ok && runs.count == 0) {
+    // Everything fit in memory: no need to touch the disk.
+    qsort(items, num_items, sizeof(SortItem), csv_compare_items);
+    for (size_t i = 0; i < num_items && ok; i++) {
+      ok = csv_write_row(out, items[i].row, self->delim, self->quote);
+    }
+  } else if (ok) {
+    if (num_items > 0) {
+      FILE* run = csv_spill_run(items, num_items);
+      ok = run && csv_push_run(&runs, run, key_cols, num_keys, num_fields);
+    }
+
+    // Release the last run before the merge needs its buffers.
+    free(items);
+    items = NULL;
+    if (run_arena) {
+      arena_destroy(run_arena);
+      run_arena = NULL;
+    }
+
+    if (ok) {
+      ok = csv_merge_all(runs.files, runs.count, out, self, key_cols, num_keys, num_fields);
+      runs.count = 0;
+    }
+  }
+
+  for (size_t i = 0; i < runs.count; i++) {
+    fclose(runs.files[i]);
+  }
+  free(runs.files);
+  free(runs.levels);
+  free(items);
+  if (run_arena) {
+    arena_destroy(run_arena);
+  }
+
+  ok = (fclose(out) == 0) && ok;
+  csv_close_stream(self);
+
+  if (!ok) {
+    fprintf(stderr, "csvparser_sort_to_file(): error sorting into %s\n", output);
+  }
+  return ok;
+}
+
+
+// ================ Random sampling ================
+#ifdef _WIN32
+#define csv_fseek _fseeki64
+#define csv_ftell _ftelli64
+#else
+#define csv_fseek fseeko
+#define csv_ftell ftello
+#endif
+
+// Rounds of random seeks before falling back to a reservoir over the whole file.
+#define CSV_SAMPLE_MAX_ROUNDS 4
+
+// Seeking only pays off when picks land on average this many bytes apart or
+// more; in smaller files most picks collide and a full scan is cheaper.
+#define CSV_SAMPLE_MIN_GAP 64
+
+typedef struct SampleItem {
+  uint64_t key;  // Offset of the end of the row, or its index when scanning
+  CsvRow* row;
+} SampleItem;
+
+// splitmix64: small and good enough to pick offsets.
+static uint64_t csv_random_next(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static int csv_compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int csv_compare_samples(const void* a, const void* b) {
+  return csv_compare_u64(&((const SampleItem*)a)->key, &((const SampleItem*)b)->key);
+}
+
+// Parse line into a freshly allocated row. Returns NULL for invalid rows.
+static CsvRow* csv_parse_sample(CsvParser* self, char* line, size_t num_fields, size_t rowIndex) {
+  CsvRow* row = arena_alloc(self->arena, sizeof(CsvRow));
+  if (!row) {
+    return NULL;
+  }
+
+  uint64_t errOffset;
+  CsvErrorCode err = csv_parse_record(self, self->arena, line, strlen(line), num_fields, rowIndex, row, &errOffset);
+  return err == CSV_ERROR_NONE ? row : NULL;
+}
+
+// Whether key is the key of one of the count samples, sorted by key.
+static bool csv_sample_seen(const SampleItem* samples, size_t count, uint64_t key) {
+  size_t lo = 0;
+  size_t hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (samples[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < count && samples[lo].key == key;
+}
+
+// Seek to random offsets and take the first row starting after each one.
+// A row is identified by the offset of its end, known before it is parsed, so
+// rows that were already picked are skipped without being parsed. Gives up
+// early when a round brings mostly duplicates: the file then has too few rows
+// for seeking to find n distinct ones cheaply.
+// Returns the number of distinct rows stored in samples, sorted by offset.
+static size_t csv_sample_offsets(CsvParser* self, FILE* fp, uint64_t data_start, uint64_t data_end, size_t n,
+                                 size_t num_fields, uint64_t* seed, SampleItem* samples) {
+  uint64_t* offsets = malloc(n * sizeof(uint64_t));
+  if (!offsets) {
+    return 0;
+  }
+
+  char line[MAX_FIELD_SIZE] = {0};
+  size_t count = 0;
+
+  for (int round = 0; round < CSV_SAMPLE_MAX_ROUNDS && count < n; round++) {
+    size_t want = n - count;
+    size_t picked = count;  // Rows picked in earlier rounds, sorted
+    for (size_t i = 0; i < want; i++) {
+      offsets[i] = data_start + csv_random_next(seed) % (data_end - data_start);
+    }
+
+    // Visit the offsets in file order to keep the reads sequential.
+    qsort(offsets, want, sizeof(uint64_t), csv_compare_u64);
+
+    for (size_t i = 0; i < want; i++) {
+      if (csv_fseek(fp, offsets[i], SEEK_SET) != 0) {
+        break;
+      }
+      self->offset = offsets[i];
+
+      // Resynchronize: unless the offset is the start of the data, the row
+      // it lands in is partial, so skip to the next line.
+      if (offsets[i] > data_start) {
+        int c;
+        while ((c = getc(fp)) != EOF && c != '\n')
+          ;
+      }
+
+      // Wrap around to the first row past the last line.
+      if (!csv_read_line(self, fp, line)) {
+        if (csv_fseek(fp, data_start, SEEK_SET) != 0) {
+          continue;
+        }
+        self->offset = data_start;
+        if (!csv_read_line(self, fp, line)) {
+          continue;
+        }
+      }
+
+      // Offsets are visited in order, so a repeat within this round is
+      // usually the previous pick.
+      uint64_t key = (uint64_t)csv_ftell(fp);
+      if ((count > picked && samples[count - 1].key == key) || csv_sample_seen(samples, picked, key)) {
+        continue;
+      }
+
+      CsvRow* row = csv_parse_sample(self, line, num_fields, count);
+      if (row) {
+        samples[count++] = (SampleItem){.key = key, .row = row};
+      }
+    }
+
+    // Drop the rare repeats left, from picks that wrapped around.
+    qsort(samples, count, sizeof(SampleItem), csv_compare_samples);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (unique == 0 || samples[unique - 1].key != samples[i].key) {
+        samples[unique++] = samples[i];
+      }
+    }
+    count = unique;
+
+    if (count - picked < want / 2) {
+      break;
+    }
+  }
+
+  free(offsets);
+  return count;
+}
+
+// Reservoir sampling over every row. Returns the number of rows stored in
+// samples, sorted by row index.
+static size_t csv_sample_reservoir(CsvParser* self, FILE* fp, uint64_t data_start, size_t n, size_t num_fields,
+                                   uint64_t* seed, SampleItem* samples) {
+  if (csv_fseek(fp, data_start, SEEK_SET) != 0) {
+    return 0;
+  }
+  self->offset = data_start;
+
+  char line[MAX_FIELD_SIZE] = {0};
+  size_t count = 0;
+  size_t seen = 0;
+
+  while (csv_read_line(self, fp, line)) {
+    size_t slot = seen < n ? seen : (size_t)(csv_random_next(seed) % (seen + 1));
+    if (slot < n) {
+      CsvRow* row = csv_parse_sample(self, line, num_fields, seen);
+      if (!row) {
+        continue;
+      }
+      samples[slot] = (SampleItem){.key = seen, .row = row};
+      if (seen < n) {
+        count++;
+      }
+    }
+    seen++;
+  }
+
+  qsort(samples, count, sizeof(SampleItem), csv_compare_samples);
+  return count;
+}
+
+CsvRow** csvparser_sample(CsvParser* self, size_t n, uint64_t seed) {
+  self->num_rows = 0;
+  self->rows = NULL;
+
+  char line[MAX_FIELD_SIZE] = {0};
+  size_t num_fields = csv_detect_num_fields(self, line);
+  if (num_fields == 0 || n == 0) {
+    csv_close_stream(self);
+    return NULL;
+  }
+
+  // Rows start after the header, if it is skipped.
+  FILE* fp = file_fp(self->stream);
+  if (self->has_header && self->skip_header) {
+    csv_read_line(self, fp, line);
+  }
+
+  int64_t data_start = csv_ftell(fp);
+  int64_t data_end = csv_fseek(fp, 0, SEEK_END) == 0 ? csv_ftell(fp) : -1;
+  if (data_start < 0 || data_end < 0) {
+    fprintf(stderr, "csvparser_sample(): error reading file\n");
+    csv_close_stream(self);
+    return NULL;
+  }
+
+  // A row takes at least two bytes, a character and a newline, so the file
+  // cannot hold more rows than this. Clamping n also bounds the allocations.
+  uint64_t data_len = data_end > data_start ? (uint64_t)(data_end - data_start) : 0;
+  if (n > (data_len + 1) / 2) {
+    n = (size_t)((data_len + 1) / 2);
+  }
+
+  SampleItem* samples = n > 0 && n <= SIZE_MAX / sizeof(SampleItem) ? malloc(n * sizeof(SampleItem)) : NULL;
+  if (!samples) {
+    if (n > 0) {
+      fprintf(stderr, "csvparser_sample(): error allocating memory for %zu samples\n", n);
+    }
+    csv_close_stream(self);
+    return NULL;
+  }
+
+  size_t count = 0;
+  if (data_len / CSV_SAMPLE_MIN_GAP >= n) {
+    count = csv_sample_offsets(self, fp, (uint64_t)data_start, (uint64_t)data_end, n, num_fields, &seed, samples);
+  }
+
+  // Too few distinct rows: the file is small compared to n, so scanning it is cheap.
+  if (count < n) {
+    count = csv_sample_reservoir(self, fp, (uint64_t)data_start, n, num_fields, &seed, samples);
+  }
+
+  self->rows = count > 0 ? arena_alloc(self->arena, count * sizeof(CsvRow*)) : NULL;
+  if (self->rows) {
+    for (size_t i = 0; i < count; i++) {
+      self->rows[i] = samples[i].row;
+    }
+    self->num_rows = count;
+  }
+
+  free(samples);
+  csv_close_stream(self);
+  return self->rows;
+}
+
+
+// ================ Key index ================
+//
+// Open addressing with linear probing. Each slot holds the first row with a
+// given key; rows sharing a key are chained through next[] in row order.
+// Row numbers are stored plus one so that zero marks an empty slot or the
+// end of a chain.
+
+typedef struct KeySlot {
+  uint32_t hash;  // Upper bits of the key hash, to skip most strcmp calls
+  uint32_t row;   // First row with this key, plus one
+} KeySlot;
+
+struct KeyIndex {
+  size_t column;   // Indexed column
+  size_t mask;     // Number of slots minus one
+  KeySlot* slots;  // Hash table
+  uint32_t* next;  // Next row with the same key, plus one
+};
+
+// FNV-1a
+static uint64_t csv_hash_key(const char* key) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
+
+bool csvparser_build_key_index(CsvParser* self, size_t column) {
+  if (!self->rows) {
+    fprintf(stderr, "csvparser_build_key_index(): no parsed rows to index\n");
+    return false;
+  }
+
+  size_t num_rows = self->num_rows;
+  if (num_rows >= UINT32_MAX) {
+    fprintf(stderr, "csvparser_build_key_index(): too many rows to index\n");
+    return false;
+  }
+
+  for (size_t r = 0; r < num_rows; r++) {
+    if (column >= self->rows[r]->numFields) {
+      fprintf(stderr, "csvparser_build_key_index(): column %zu out of range\n", column);
+      return false;
+    }
+  }
+
+  // Keep the load factor at or below one half.
+  size_t capacity = 16;
+  while (capacity < num_rows * 2) {
+    capacity *= 2;
+  }
+
+  KeyIndex* index = arena_alloc(self->arena, sizeof(KeyIndex));
+  KeySlot* slots = arena_alloc(self->arena, capacity * sizeof(KeySlot));
+  uint32_t* next = arena_alloc(self->arena, (num_rows ? num_rows : 1) * sizeof(uint32_t));
+  if (!index || !slots || !next) {
+    fprintf(stderr, "csvparser_build_key_index(): error allocating memory for index\n");
+    return false;
+  }
+
+  memset(slots, 0, capacity * sizeof(KeySlot));
+  index->column = column;
+  index->mask = capacity - 1;
+  index->slots = slots;
+  index->next = next;
+
+  // Insert in reverse so that prepending leaves each chain in row order.
+  for (size_t r = num_rows; r-- > 0;) {
+    const char* key = csvrow_field(self->rows[r], column);
+    uint64_t hash = csv_hash_key(key);
+    uint32_t tag = (uint32_t)(hash >> 32);
+    size_t i = (size_t)hash & index->mask;
+
+    while (slots[i].row != 0 &&
+           (slots[i].hash != tag || strcmp(self->rows[slots[i].row - 1]->fields[column], key) != 0)) {
+      i = (i + 1) & index->mask;
+    }
+
+    next[r] = slots[i].row;
+    slots[i].hash = tag;
+    slots[i].row = (uint32_t)r + 1;
+  }
+
+  self->key_index = index;
+  return true;
+}
+
+size_t csvparser_lookup(const CsvParser* self, const char* key, CsvRow** out, size_t max) {
+  const KeyIndex* index = self->key_index;
+  if (!index || !key) {
+    return 0;
+  }
+
+  uint64_t hash = csv_hash_key(key);
+  uint32_t tag = (uint32_t)(hash >> 32);
+  size_t i = (size_t)hash & index->mask;
+
+  while (index->slots[i].row != 0) {
+    uint32_t row = index->slots[i].row;
+    if (index->slots[i].hash == tag && strcmp(self->rows[row - 1]->fields[index->column], key) == 0) {
+      size_t count = 0;
+      for (; row != 0; row = index->next[row - 1]) {
+        if (count < max) {
+          out[count] = self->rows[row - 1];
+        }
+        count++;
+      }
+      return count;
+    }
+    i = (i + 1) & index->mask;
+  }
+  return 0;
+}
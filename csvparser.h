@@ -9,13 +9,16 @@
 #define __CSV_PARSER_H__
 
 // If clang, ignore the initializer-overrides warning
+// (CSV_SETCONFIG is C only: GCC rejects -Woverride-init in C++)
 #ifdef __clang__
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Winitializer-overrides"
 #else
 #pragma GCC diagnostic push
+#ifndef __cplusplus
 #pragma GCC diagnostic ignored "-Woverride-init"
 #endif
+#endif
 
 // C++ compatibility
 #ifdef __cplusplus
@@ -32,6 +35,7 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifndef CSV_ARENA_BLOCK_SIZE
 #define CSV_ARENA_BLOCK_SIZE 4096
@@ -42,6 +46,11 @@ extern "C" {
 #define MAX_FIELD_SIZE 1024
 #endif
 
+#ifndef CSV_SORT_DEFAULT_MEM_LIMIT
+// Memory budget of csvparser_sort_to_file when mem_limit is 0.
+#define CSV_SORT_DEFAULT_MEM_LIMIT (64 * 1024 * 1024)
+#endif
+
 /**
  * @brief Opaque structure representing a CSV parser.
  * Create a new CSV parser with csvparser_new and free it with csvparser_free.
@@ -63,6 +72,40 @@ typedef struct CsvRow {
   size_t numFields;  ///< Number of fields in each row.
 } CsvRow;
 
+/**
+ * @brief Get a field of a row, with bounds checking.
+ *
+ * Quoted fields follow RFC 4180: surrounding quotes are removed and doubled
+ * quotes ("say ""hi""") are collapsed while the row is parsed, so this returns
+ * the same text as row->fields[index]. It never modifies the row and is safe to
+ * call from several threads at once.
+ *
+ * @param row The row.
+ * @param index Zero-based index of the field.
+ * @return The field, or NULL if index is out of range.
+ */
+const char* csvrow_field(const CsvRow* row, size_t index);
+
+/**
+ * @brief Reasons a row can be rejected.
+ */
+typedef enum CsvErrorCode {
+  CSV_ERROR_NONE = 0,            ///< No error.
+  CSV_ERROR_FIELD_COUNT,         ///< The row has a different number of fields than the first row.
+  CSV_ERROR_UNTERMINATED_QUOTE,  ///< A quoted field is not closed by the end of the line.
+  CSV_ERROR_ALLOC,               ///< Memory for the row could not be allocated.
+  CSV_ERROR_INVALID_UTF8,        ///< The row is not valid UTF-8 (only with CsvConfig.validate_utf8).
+} CsvErrorCode;
+
+/**
+ * @brief An invalid row found while parsing.
+ */
+typedef struct CsvError {
+  size_t row;         ///< Zero-based index of the row among all data rows, valid or not.
+  uint64_t offset;    ///< Byte offset of the row in the file, or of the invalid byte for CSV_ERROR_INVALID_UTF8.
+  CsvErrorCode code;  ///< Why the row was rejected.
+} CsvError;
+
 // callback to process every row as its parsed.
 typedef void (*RowCallback)(size_t rowIndex, CsvRow* row);
 
@@ -97,15 +140,70 @@ CsvRow** csvparser_parse(CsvParser* self);
  * Return true from the callback to stop early.
  * The parser file descriptor and stream will automatically be closed.
  *
- * If alloc_max is 0, the parser will allocate all rows at once;
- * otherwise it will allocate alloc_max rows.
+ * If alloc_max is 0, every row is parsed; otherwise at most alloc_max rows are.
+ * Rows are allocated as they are parsed, so a large alloc_max costs nothing
+ * on a small file.
  * 
  * @param self A pointer to the CsvParser.
- * @param alloc_max The maximum number of rows to allocate at once.
+ * @param alloc_max The maximum number of rows to parse, or 0 for all of them.
  * @return void.
  */
 void csvparser_parse_async(CsvParser* self, RowCallback callback, size_t alloc_max);
 
+/**
+ * @brief Parse the next row of the CSV data.
+ *
+ * Rows are read one at a time, on demand, so iteration can stop at any point
+ * without reading the rest of the file. Header, comment and empty lines are
+ * skipped as in csvparser_parse.
+ *
+ * Nothing is allocated per row or per field: the returned row and its fields
+ * live in a buffer owned by the parser, split in place, and are overwritten by
+ * the next call. Copy whatever must outlive it. Memory use is therefore bounded
+ * by MAX_FIELD_SIZE whatever the size of the file. Streamed rows are not
+ * collected: csvparser_rows and csvparser_numrows do not change.
+ * The stream is closed when the end of the file is reached.
+ *
+ * Do not mix with csvparser_parse or the other functions that consume the file.
+ *
+ * @param self A pointer to the CsvParser.
+ * @return The next row, or NULL at the end of the file or at an invalid row
+ * (unless CsvConfig.lenient is set, in which case invalid rows are skipped).
+ */
+CsvRow* csvparser_next(CsvParser* self);
+
+/**
+ * @brief Parse only the first n rows of the CSV data.
+ *
+ * Unlike csvparser_parse, this does not scan the whole file first, so the cost
+ * is proportional to n rather than to the size of the file.
+ * The parser file descriptor and stream will automatically be closed.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param n The maximum number of rows to parse.
+ * @return An array of csvparser_numrows() rows, or NULL on error.
+ */
+CsvRow** csvparser_head(CsvParser* self, size_t n);
+
+/**
+ * @brief Parse a random sample of n rows of the CSV data.
+ *
+ * The sampler seeks to random byte offsets and takes the first row starting
+ * after each one, so it runs in time roughly proportional to n. Rows that follow
+ * long rows are somewhat more likely to be picked. When the file is small
+ * compared to n, or seeking keeps landing on rows already picked, it falls back
+ * to a uniform reservoir sample of a full scan. Either way time and memory are
+ * bounded by the size of the file, whatever n is. Rows are returned in file
+ * order; invalid rows are never sampled.
+ * The parser file descriptor and stream will automatically be closed.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param n The number of rows to sample.
+ * @param seed Seed of the random generator; the same seed gives the same sample.
+ * @return An array of csvparser_numrows() rows (at most n), or NULL on error.
+ */
+CsvRow** csvparser_sample(CsvParser* self, size_t n, uint64_t seed);
+
 /**
  * @brief Get the number of rows in the CSV data.
  *
@@ -117,6 +215,61 @@ void csvparser_parse_async(CsvParser* self, RowCallback callback, size_t alloc_m
  */
 size_t csvparser_numrows(const CsvParser* self);
 
+/**
+ * @brief Get the rows parsed so far.
+ *
+ * @param self A pointer to the CsvParser.
+ * @return The array of csvparser_numrows() rows, or NULL if nothing was parsed.
+ */
+CsvRow** csvparser_rows(const CsvParser* self);
+
+/**
+ * @brief Build a hash index on a column for csvparser_lookup.
+ *
+ * Call after the rows are parsed with csvparser_parse, csvparser_head,
+ * csvparser_sample or csvparser_open_cached. The index maps each value of the column to
+ * the rows holding it and replaces any previous index. It is allocated in the
+ * parser arena and freed with the parser.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param column Zero-based index of the key column.
+ * @return true on success, false if no rows were parsed, the column is out of range or memory runs out.
+ */
+bool csvparser_build_key_index(CsvParser* self, size_t column);
+
+/**
+ * @brief Find the rows whose key column equals key.
+ *
+ * Runs in constant expected time using the index built by csvparser_build_key_index.
+ * Matching rows are stored in out in file order, at most max of them; pass max 0
+ * to only count them.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param key The key to look up.
+ * @param out Array receiving the matching rows.
+ * @param max The capacity of out.
+ * @return The total number of matching rows (which may exceed max), or 0 if there is no index.
+ */
+size_t csvparser_lookup(const CsvParser* self, const char* key, CsvRow** out, size_t max);
+
+/**
+ * @brief Get the errors found while parsing.
+ *
+ * In strict mode (the default), parsing stops at the first invalid row, so
+ * there is at most one error. In lenient mode (CsvConfig.lenient), invalid rows
+ * are skipped and every one of them is listed here instead of being printed.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param count Set to the number of errors.
+ * @return The array of errors, valid until csvparser_free; NULL if there are none.
+ */
+const CsvError* csvparser_errors(const CsvParser* self, size_t* count);
+
+/**
+ * @brief Get a human-readable description of an error code.
+ */
+const char* csvparser_strerror(CsvErrorCode code);
+
 /**
  * @brief Free memory used by the CsvParser and CsvRow structures.
  *
@@ -132,6 +285,8 @@ struct CsvConfig {
   char comment;
   bool has_header;
   bool skip_header;
+  bool lenient;        // Skip invalid rows and collect them in csvparser_errors instead of stopping.
+  bool validate_utf8;  // Treat rows that are not valid UTF-8 as invalid.
 };
 
 typedef struct CsvConfig CsvConfig;
@@ -141,7 +296,71 @@ void csvparser_setconfig(CsvParser* parser, CsvConfig config);
 #define CSV_SETCONFIG(parser, ...)                                                                                     \
   csvparser_setconfig(                                                                                                 \
     parser,                                                                                                            \
-    (CsvConfig){.delim = ',', .quote = '"', .comment = '#', .has_header = true, .skip_header = true, __VA_ARGS__})
+    (CsvConfig){.delim = ',', .quote = '"', .comment = '#', .has_header = true, .skip_header = true, .lenient = false, \
+                __VA_ARGS__})
+
+/**
+ * @brief Open and parse a CSV file, reusing a binary snapshot of a previous parse.
+ *
+ * The first call parses the file and writes a columnar snapshot (row count,
+ * dialect and one string heap per column) to "<basename>.<hash>.csvcache" in
+ * cache_dir, where hash is that of the absolute path of the file, or to
+ * "<filename>.csvcache" when cache_dir is NULL. Later calls memory-map the
+ * snapshot instead of parsing, as long as the source file (device and inode),
+ * its size and mtime and the dialect still match.
+ *
+ * The returned parser already holds all the rows; retrieve them with
+ * csvparser_rows and csvparser_numrows and free it with csvparser_free.
+ * The snapshot also records the errors of the parse, so csvparser_errors
+ * lists the same invalid rows whether or not the snapshot was used.
+ *
+ * @param filename The filename of the CSV file to parse.
+ * @param config The parser configuration, or NULL for the defaults.
+ * @param cache_dir Directory for the snapshot, or NULL to store it next to the file.
+ * @return A pointer to the parsed CsvParser, or NULL on failure.
+ */
+CsvParser* csvparser_open_cached(const char* filename, const CsvConfig* config, const char* cache_dir);
+
+/**
+ * @brief Count the rows of a CSV file without parsing it.
+ *
+ * The file is memory-mapped and split between nthreads threads that count
+ * record terminators. Blank lines, comment lines and a skipped header are
+ * excluded exactly as csvparser_parse does, so the result equals
+ * csvparser_numrows after a parse that found no invalid row.
+ *
+ * The count does not track quotes: the parser never lets a quoted field span
+ * lines, so every newline ends a record. Lines longer than MAX_FIELD_SIZE - 1
+ * bytes are read by the parser in several pieces and counted as that many rows,
+ * blank and comment pieces excepted.
+ *
+ * @param filename The filename of the CSV file.
+ * @param config The parser configuration, or NULL for the defaults.
+ * @param nthreads The number of threads to use, or 0 for one per CPU.
+ * @return The number of rows, or 0 if the file cannot be read.
+ */
+size_t csvparser_count_rows(const char* filename, const CsvConfig* config, size_t nthreads);
+
+/**
+ * @brief Sort the CSV data by one or more columns and write it to a new CSV file.
+ *
+ * The file may be larger than memory: rows are parsed until mem_limit bytes are in
+ * use, sorted and spilled to temporary files, which are then merged into output.
+ * Fields that parse as numbers compare numerically and sort before text, which
+ * compares bytewise. The sort is stable. If the file has a header, it is written
+ * first, unsorted.
+ *
+ * The parser file descriptor and stream will automatically be closed.
+ *
+ * @param self A pointer to the CsvParser.
+ * @param key_cols Zero-based indices of the sort columns, most significant first.
+ * @param num_keys The number of entries in key_cols.
+ * @param output The filename of the sorted CSV file to write.
+ * @param mem_limit Approximate memory budget in bytes, or 0 for CSV_SORT_DEFAULT_MEM_LIMIT.
+ * @return true on success, false on error.
+ */
+bool csvparser_sort_to_file(CsvParser* self, const size_t* key_cols, size_t num_keys, const char* output,
+                            size_t mem_limit);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,349 @@
+/**
+ * @file csvparser.hpp
+ * @brief Header-only C++17 wrapper of the CSV Parser Library.
+ *
+ * csv::Parser owns a CsvParser and frees it on destruction. Rows are exposed as
+ * csv::Row views whose fields are std::string_view pointing into the parser:
+ * nothing is copied. Rows from parse(), head() and sample(), and the views into
+ * them, stay valid for as long as the parser. A row from stream() or for_each()
+ * reuses one buffer and is only valid until the stream advances.
+ *
+ * @code
+ * csv::Parser parser("data.csv");
+ * for (csv::Row row : parser.stream()) {
+ *   std::string_view name = row[0];
+ * }
+ * @endcode
+ */
+#ifndef __CSV_PARSER_HPP__
+#define __CSV_PARSER_HPP__
+
+#include "csvparser.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace csv {
+
+/// The default configuration, as set by csvparser_new.
+inline CsvConfig default_config() noexcept {
+  CsvConfig config{};
+  config.delim = ',';
+  config.quote = '"';
+  config.comment = '#';
+  config.has_header = true;
+  config.skip_header = true;
+  return config;
+}
+
+namespace detail {
+
+// Random access iterator over a cheap-to-copy view with operator[](size_t).
+// The view is held by value, so iterators outlive temporary views.
+// Dereferencing returns by value, so it is an input iterator to C++17 algorithms
+// and a random access iterator to C++20 ranges.
+template <typename Container, typename Value>
+class IndexIterator {
+ public:
+  using iterator_concept = std::random_access_iterator_tag;
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Value;
+  using difference_type = std::ptrdiff_t;
+  using reference = Value;
+  using pointer = void;
+
+  IndexIterator() noexcept = default;
+  IndexIterator(Container container, std::size_t index) noexcept : container_(container), index_(index) {}
+
+  Value operator*() const { return container_[index_]; }
+  Value operator[](difference_type n) const { return container_[index_ + n]; }
+
+  IndexIterator& operator++() noexcept {
+    ++index_;
+    return *this;
+  }
+  IndexIterator operator++(int) noexcept {
+    IndexIterator it = *this;
+    ++index_;
+    return it;
+  }
+  IndexIterator& operator--() noexcept {
+    --index_;
+    return *this;
+  }
+  IndexIterator operator--(int) noexcept {
+    IndexIterator it = *this;
+    --index_;
+    return it;
+  }
+
+  IndexIterator& operator+=(difference_type n) noexcept {
+    index_ += n;
+    return *this;
+  }
+  IndexIterator& operator-=(difference_type n) noexcept {
+    index_ -= n;
+    return *this;
+  }
+
+  friend IndexIterator operator+(IndexIterator it, difference_type n) noexcept { return it += n; }
+  friend IndexIterator operator+(difference_type n, IndexIterator it) noexcept { return it += n; }
+  friend IndexIterator operator-(IndexIterator it, difference_type n) noexcept { return it -= n; }
+  friend difference_type operator-(const IndexIterator& a, const IndexIterator& b) noexcept {
+    return static_cast<difference_type>(a.index_) - static_cast<difference_type>(b.index_);
+  }
+
+  friend bool operator==(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ == b.index_; }
+  friend bool operator!=(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ != b.index_; }
+  friend bool operator<(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ < b.index_; }
+  friend bool operator>(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ > b.index_; }
+  friend bool operator<=(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ <= b.index_; }
+  friend bool operator>=(const IndexIterator& a, const IndexIterator& b) noexcept { return a.index_ >= b.index_; }
+
+ private:
+  Container container_{};
+  std::size_t index_ = 0;
+};
+
+}  // namespace detail
+
+/**
+ * @brief Non-owning view of a row: a random access range of std::string_view fields.
+ */
+class Row {
+ public:
+  using iterator = detail::IndexIterator<Row, std::string_view>;
+
+  Row() noexcept = default;
+  explicit Row(CsvRow* row) noexcept : row_(row) {}
+
+  std::size_t size() const noexcept { return row_ ? row_->numFields : 0; }
+  bool empty() const noexcept { return size() == 0; }
+
+  /// Field i. Not bounds checked.
+  std::string_view operator[](std::size_t i) const {
+    const char* field = row_->fields[i];
+    return std::string_view(field, std::strlen(field));
+  }
+
+  /// Field i. Throws std::out_of_range.
+  std::string_view at(std::size_t i) const {
+    if (i >= size()) {
+      throw std::out_of_range("csv::Row::at: field index out of range");
+    }
+    return (*this)[i];
+  }
+
+  iterator begin() const noexcept { return iterator(*this, 0); }
+  iterator end() const noexcept { return iterator(*this, size()); }
+
+  CsvRow* get() const noexcept { return row_; }
+
+ private:
+  CsvRow* row_ = nullptr;
+};
+
+/**
+ * @brief Non-owning view of parsed rows: a random access range of csv::Row.
+ */
+class Rows {
+ public:
+  using iterator = detail::IndexIterator<Rows, Row>;
+
+  Rows() noexcept = default;
+  Rows(CsvRow** rows, std::size_t size) noexcept : rows_(rows), size_(size) {}
+
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+  Row operator[](std::size_t i) const noexcept { return Row(rows_[i]); }
+
+  iterator begin() const noexcept { return iterator(*this, 0); }
+  iterator end() const noexcept { return iterator(*this, size_); }
+
+ private:
+  CsvRow** rows_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+/**
+ * @brief Lazy input range over the rows of a parser, read with csvparser_next.
+ *
+ * Rows are parsed as the range is advanced; stopping early leaves the rest of
+ * the file unread. It is single-pass: begin() may only be called once.
+ * Every row is parsed into the same buffer, so a row and its fields are only
+ * valid until the iterator is incremented.
+ */
+class RowStream {
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Row;
+    using difference_type = std::ptrdiff_t;
+    using reference = Row;
+    using pointer = void;
+
+    iterator() noexcept = default;
+    explicit iterator(CsvParser* parser) : parser_(parser), row_(csvparser_next(parser)) {}
+
+    Row operator*() const noexcept { return Row(row_); }
+
+    iterator& operator++() {
+      row_ = csvparser_next(parser_);
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+
+    friend bool operator==(const iterator& a, const iterator& b) noexcept { return a.row_ == b.row_; }
+    friend bool operator!=(const iterator& a, const iterator& b) noexcept { return a.row_ != b.row_; }
+
+   private:
+    CsvParser* parser_ = nullptr;
+    CsvRow* row_ = nullptr;
+  };
+
+  explicit RowStream(CsvParser* parser) noexcept : parser_(parser) {}
+
+  iterator begin() const { return iterator(parser_); }
+  iterator end() const noexcept { return iterator(); }
+
+ private:
+  CsvParser* parser_;
+};
+
+/**
+ * @brief Move-only owner of a CsvParser.
+ *
+ * Like the C API, a parser reads its file once: use one of parse(), head(),
+ * sample(), stream() or for_each() per parser.
+ */
+class Parser {
+ public:
+  /// Open filename. Throws std::runtime_error if it cannot be opened.
+  explicit Parser(const std::string& filename, const CsvConfig& config = default_config())
+      : parser_(csvparser_new(filename.c_str())) {
+    if (!parser_) {
+      throw std::runtime_error("csv::Parser: unable to open " + filename);
+    }
+    csvparser_setconfig(parser_, config);
+  }
+
+  /// Take ownership of an existing parser.
+  explicit Parser(CsvParser* parser) noexcept : parser_(parser) {}
+
+  /// Open and parse filename through the snapshot cache (see csvparser_open_cached).
+  static Parser open_cached(const std::string& filename, const CsvConfig& config = default_config(),
+                            const char* cache_dir = nullptr) {
+    CsvParser* parser = csvparser_open_cached(filename.c_str(), &config, cache_dir);
+    if (!parser) {
+      throw std::runtime_error("csv::Parser: unable to open " + filename);
+    }
+    return Parser(parser);
+  }
+
+  Parser(const Parser&) = delete;
+  Parser& operator=(const Parser&) = delete;
+
+  Parser(Parser&& other) noexcept : parser_(std::exchange(other.parser_, nullptr)) {}
+  Parser& operator=(Parser&& other) noexcept {
+    if (this != &other) {
+      csvparser_free(parser_);
+      parser_ = std::exchange(other.parser_, nullptr);
+    }
+    return *this;
+  }
+
+  ~Parser() { csvparser_free(parser_); }
+
+  /// Parse all rows. Throws std::runtime_error on failure.
+  Rows parse() {
+    if (!csvparser_parse(parser_)) {
+      throw std::runtime_error("csv::Parser: unable to parse CSV data");
+    }
+    return rows();
+  }
+
+  /// Parse the first n rows only (see csvparser_head).
+  Rows head(std::size_t n) {
+    csvparser_head(parser_, n);
+    return rows();
+  }
+
+  /// Parse a random sample of n rows (see csvparser_sample).
+  Rows sample(std::size_t n, std::uint64_t seed) {
+    csvparser_sample(parser_, n, seed);
+    return rows();
+  }
+
+  /// The rows parsed so far by parse(), head(), sample() or open_cached().
+  Rows rows() const noexcept {
+    CsvRow** rows = csvparser_rows(parser_);
+    return rows ? Rows(rows, csvparser_numrows(parser_)) : Rows();
+  }
+
+  /// Lazily parse rows one at a time as the range is iterated.
+  RowStream stream() noexcept { return RowStream(parser_); }
+
+  /**
+   * @brief Call fn for every row as it is parsed.
+   *
+   * fn is any callable, lambdas with captures included, invoked as
+   * fn(std::size_t index, csv::Row row). If it returns bool, returning true stops early.
+   * The row is only valid during the call.
+   *
+   * @return The number of rows passed to fn.
+   */
+  template <typename Fn>
+  std::size_t for_each(Fn&& fn) {
+    std::size_t index = 0;
+    for (Row row : stream()) {
+      if constexpr (std::is_convertible_v<std::invoke_result_t<Fn&, std::size_t, Row>, bool>) {
+        if (fn(index++, row)) {
+          break;
+        }
+      } else {
+        fn(index++, row);
+      }
+    }
+    return index;
+  }
+
+  /// Build a hash index on column of rows() for lookup(). Throws std::runtime_error on failure,
+  /// which includes calling it on a parser that was only streamed.
+  void build_key_index(std::size_t column) {
+    if (!csvparser_build_key_index(parser_, column)) {
+      throw std::runtime_error("csv::Parser: unable to build key index");
+    }
+  }
+
+  /// Every row whose indexed column equals key, in file order; empty if there is none.
+  std::vector<Row> lookup(const std::string& key) const {
+    std::size_t count = csvparser_lookup(parser_, key.c_str(), nullptr, 0);
+    std::vector<CsvRow*> rows(count);
+    if (count > 0) {
+      csvparser_lookup(parser_, key.c_str(), rows.data(), count);
+    }
+    return std::vector<Row>(rows.begin(), rows.end());
+  }
+
+  /// The number of rows in rows(). Rows read through stream() or for_each() are not counted.
+  std::size_t size() const noexcept { return csvparser_numrows(parser_); }
+
+  CsvParser* get() const noexcept { return parser_; }
+  CsvParser* release() noexcept { return std::exchange(parser_, nullptr); }
+
+ private:
+  CsvParser* parser_;
+};
+
+}  // namespace csv
+
+#endif /* __CSV_PARSER_HPP__ */
@@ -22,8 +22,8 @@ unsigned long to_number(const char* str) {
 
 void parseItem(CsvRow* row, Item* item) {
   if (row->numFields == 2) {
-    strncpy(item->name, row->fields[0], sizeof(item->name) - 1);
-    item->price = to_number(row->fields[1]);
+    strncpy(item->name, csvrow_field(row, 0), sizeof(item->name) - 1);
+    item->price = to_number(csvrow_field(row, 1));
   }
 }
 
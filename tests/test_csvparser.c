@@ -1,47 +1,85 @@
 #include <solidc/filepath.h>
 #include "../csvparser.h"
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+// Number of failed test cases; returned as the exit status.
+static int failures = 0;
 
 // Function to compare two CsvRow objects
-static bool compareCsvRows(const CsvRow* expected, const CsvRow* actual) {
+static bool compareCsvRows(const CsvRow* expected, CsvRow* actual) {
   if (expected->numFields != actual->numFields) {
     return false;
   }
 
   for (size_t i = 0; i < expected->numFields; i++) {
-    if (strcmp(expected->fields[i], actual->fields[i]) != 0) {
-      printf("Expected: %s, Actual: %s\n", expected->fields[i], actual->fields[i]);
+    if (strcmp(expected->fields[i], csvrow_field(actual, i)) != 0) {
+      printf("Expected: %s, Actual: %s\n", expected->fields[i], csvrow_field(actual, i));
       return false;
     }
   }
   return true;
 }
 
-// Function to run a CSV parser test case
-static void runCsvParserTestCase(const char* csvData, CsvRow* expectedRows, size_t numExpectedRows, bool skipHeader,
-                                 bool hasHeader) {
-  // Create a temporary file and write the CSV data
+// Create a temporary file holding csvData. The caller frees the returned path.
+static char* writeTempCsv(const char* csvData) {
   char* tmpfile = make_tempfile();
   if (!tmpfile) {
     printf("Error creating temporary file\n");
-    return;
+    return NULL;
   }
 
   FILE* file = fopen(tmpfile, "w");
   if (!file) {
     printf("Error creating temporary file\n");
-    return;
+    free(tmpfile);
+    return NULL;
   }
 
   fwrite(csvData, 1, strlen(csvData), file);
   fclose(file);
+  return tmpfile;
+}
+
+// Compare a parsed row array against the expected rows.
+static bool compareAllRows(CsvRow* expectedRows, size_t numExpectedRows, CsvRow** rows, size_t numRows) {
+  if (numRows != numExpectedRows) {
+    printf("Test failed: Expected %zu rows, but got %zu rows\n", numExpectedRows, numRows);
+    return false;
+  }
+
+  for (size_t i = 0; i < numExpectedRows; i++) {
+    if (!compareCsvRows(&expectedRows[i], rows[i])) {
+      printf("Test failed: Row %zu mismatch\n", i + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Function to run a CSV parser test case
+static void runCsvParserTestCase(const char* csvData, CsvRow* expectedRows, size_t numExpectedRows, bool skipHeader,
+                                 bool hasHeader) {
+  // Create a temporary file and write the CSV data
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
 
   // Create a CSV parser from the file descriptor
   CsvParser* parser = csvparser_new(tmpfile);
   if (!parser) {
     printf("Error creating CSV parser\n");
+    failures++;
     return;
   }
 
@@ -51,29 +89,699 @@ static void runCsvParserTestCase(const char* csvData, CsvRow* expectedRows, size
   CsvRow** rows = csvparser_parse(parser);
   if (!rows) {
     printf("Error parsing CSV file\n");
+    failures++;
+    return;
+  }
+
+  // Verify the number of rows and compare each row
+  if (compareAllRows(expectedRows, numExpectedRows, rows, csvparser_numrows(parser))) {
+    printf("Test passed\n");
+  } else {
+    failures++;
+  }
+
+  // Free resources
+  csvparser_free(parser);
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Alter the last field of the snapshot in place, the last string of its heap.
+// Returns false if the snapshot does not end with that field.
+static bool patchCacheFile(const char* cachefile, const char* field, char marker) {
+  FILE* file = fopen(cachefile, "r+b");
+  if (!file) {
+    return false;
+  }
+
+  char tail[256] = {0};
+  long len = (long)strlen(field) + 1;
+  bool ok = len <= (long)sizeof(tail) && fseek(file, -len, SEEK_END) == 0 && fread(tail, 1, len, file) == (size_t)len &&
+            memcmp(tail, field, len) == 0 && fseek(file, -len, SEEK_END) == 0 && fputc(marker, file) == marker;
+  return (fclose(file) == 0) && ok;
+}
+
+// Parse through the snapshot cache twice: once writing it, once loading it.
+// The snapshot is altered in between, so the second pass must show the change.
+static void testCachedOpen(const char* csvData, CsvRow* expectedRows, size_t numExpectedRows) {
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  char cachefile[512];
+  snprintf(cachefile, sizeof(cachefile), "%s.csvcache", tmpfile);
+
+  // The last row as the altered snapshot holds it.
+  CsvRow lastRow = expectedRows[numExpectedRows - 1];
+  size_t lastField = lastRow.numFields - 1;
+  char* patchedFields[16];
+  char patched[256];
+  snprintf(patched, sizeof(patched), "%s", lastRow.fields[lastField]);
+  patched[0] = '~';
+  memcpy(patchedFields, lastRow.fields, lastRow.numFields * sizeof(char*));
+  patchedFields[lastField] = patched;
+  lastRow.fields = patchedFields;
+
+  bool ok = true;
+  for (int pass = 0; pass < 2 && ok; pass++) {
+    CsvParser* parser = csvparser_open_cached(tmpfile, NULL, NULL);
+    if (!parser) {
+      printf("Test failed: csvparser_open_cached returned NULL on pass %d\n", pass);
+      ok = false;
+      break;
+    }
+
+    CsvRow** rows = csvparser_rows(parser);
+    if (pass == 0) {
+      ok = compareAllRows(expectedRows, numExpectedRows, rows, csvparser_numrows(parser));
+    } else {
+      ok = compareAllRows(expectedRows, numExpectedRows - 1, rows, csvparser_numrows(parser) - 1) &&
+           compareCsvRows(&lastRow, rows[numExpectedRows - 1]);
+      if (!ok) {
+        printf("Test failed: the second pass did not load the snapshot\n");
+      }
+    }
+    csvparser_free(parser);
+
+    if (pass == 0 && ok && !patchCacheFile(cachefile, expectedRows[numExpectedRows - 1].fields[lastField], '~')) {
+      printf("Test failed: cache file %s was not written\n", cachefile);
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    failures++;
+  }
+
+  remove(cachefile);
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Sort by a numeric then a text column with a budget small enough to spill runs.
+static void testSortToFile(void) {
+  const char* csvData =
+    "name,age\n"
+    "Dan,30\n"
+    "Alice,25\n"
+    "Carol,100\n"
+    "Bob,30\n"
+    "Eve,9\n";
+
+  const char* expected =
+    "name,age\n"
+    "Eve,9\n"
+    "Alice,25\n"
+    "Bob,30\n"
+    "Dan,30\n"
+    "Carol,100\n";
+
+  char* tmpfile = writeTempCsv(csvData);
+  char* outfile = make_tempfile();
+  if (!tmpfile || !outfile) {
+    failures++;
+    free(tmpfile);
+    free(outfile);
+    return;
+  }
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  size_t keys[] = {1, 0};
+  bool ok = parser && csvparser_sort_to_file(parser, keys, 2, outfile, 1);
+  csvparser_free(parser);
+
+  char actual[256] = {0};
+  FILE* file = ok ? fopen(outfile, "r") : NULL;
+  if (file) {
+    fread(actual, 1, sizeof(actual) - 1, file);
+    fclose(file);
+  }
+
+  if (ok && strcmp(actual, expected) == 0) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: sorted output mismatch:\n%s\n", actual);
+    failures++;
+  }
+
+  remove(tmpfile);
+  remove(outfile);
+  free(tmpfile);
+  free(outfile);
+}
+
+// Sort with one row per run: far more runs than CSV_SORT_MAX_FANIN, merged in
+// cascades while spilling. The open file limit is lowered below the number of
+// runs, so runs that were all kept open at once would make the sort fail.
+static void testSortManyRuns(void) {
+  const size_t numRows = 5000;
+  char* csvData = malloc(numRows * 24 + 16);
+  if (!csvData) {
+    failures++;
     return;
   }
 
-  // Verify the number of rows
-  size_t num_rows = csvparser_numrows(parser);
-  if (num_rows != numExpectedRows) {
-    printf("Test failed: Expected %zu rows, but got %zu rows\n", numExpectedRows, num_rows);
-    for (size_t i = 0; i < numExpectedRows; i++) {
-      compareCsvRows(&expectedRows[i], rows[i]);
+  // Many equal keys, so that a merge that is not stable breaks the seq order.
+  char* p = csvData + sprintf(csvData, "key,seq\n");
+  for (size_t i = 0; i < numRows; i++) {
+    p += sprintf(p, "%zu,%zu\n", (i * 7919) % 100, i);
+  }
+
+  char* tmpfile = writeTempCsv(csvData);
+  char* outfile = make_tempfile();
+  free(csvData);
+  if (!tmpfile || !outfile) {
+    failures++;
+    free(tmpfile);
+    free(outfile);
+    return;
+  }
+
+  struct rlimit saved;
+  bool limited = getrlimit(RLIMIT_NOFILE, &saved) == 0;
+  if (limited) {
+    struct rlimit lowered = {.rlim_cur = 256, .rlim_max = saved.rlim_max};
+    limited = saved.rlim_cur > lowered.rlim_cur && setrlimit(RLIMIT_NOFILE, &lowered) == 0;
+  }
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  size_t keys[] = {0};
+  bool ok = parser && csvparser_sort_to_file(parser, keys, 1, outfile, 1);
+  csvparser_free(parser);
+
+  if (limited) {
+    setrlimit(RLIMIT_NOFILE, &saved);
+  }
+
+  FILE* file = ok ? fopen(outfile, "r") : NULL;
+  size_t count = 0;
+  if (file) {
+    char line[64];
+    long key, seq, prevKey = -1, prevSeq = -1;
+    ok = fgets(line, sizeof(line), file) && strcmp(line, "key,seq\n") == 0;
+    while (ok && fscanf(file, "%ld,%ld\n", &key, &seq) == 2) {
+      ok = key > prevKey || (key == prevKey && seq > prevSeq);
+      prevKey = key;
+      prevSeq = seq;
+      count++;
     }
+    fclose(file);
+  }
+
+  if (ok && count == numRows) {
+    printf("Test passed\n");
   } else {
-    // Compare each row
-    for (size_t i = 0; i < numExpectedRows; i++) {
-      if (!compareCsvRows(&expectedRows[i], rows[i])) {
-        printf("Test failed: Row %zu mismatch\n", i + 1);
+    printf("Test failed: sort with many runs wrote %zu of %zu rows\n", count, numRows);
+    failures++;
+  }
+
+  remove(tmpfile);
+  remove(outfile);
+  free(tmpfile);
+  free(outfile);
+}
+
+// Parse rows with csvparser_head or csvparser_sample and compare them.
+static void testHeadAndSample(const char* csvData, CsvRow* expectedRows, size_t numExpectedRows, bool sample,
+                              size_t n) {
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  if (!parser) {
+    printf("Error creating CSV parser\n");
+    failures++;
+    free(tmpfile);
+    return;
+  }
+
+  CsvRow** rows = sample ? csvparser_sample(parser, n, 1) : csvparser_head(parser, n);
+  if (rows && compareAllRows(expectedRows, numExpectedRows, rows, csvparser_numrows(parser))) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: %s of %zu rows\n", sample ? "sample" : "head", n);
+    failures++;
+  }
+
+  csvparser_free(parser);
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Sample n rows of a large file through random seeks. Every row must be whole
+// (the second field is twice the first, which a partial row would break),
+// distinct, in file order, and the same seed must give the same sample.
+static void testSampleLarge(size_t n) {
+  const size_t numRows = 20000;
+  char* csvData = malloc(numRows * 16 + 16);
+  if (!csvData) {
+    failures++;
+    return;
+  }
+
+  char* p = csvData + sprintf(csvData, "id,twice\n");
+  for (size_t i = 0; i < numRows; i++) {
+    p += sprintf(p, "%zu,%zu\n", i, 2 * i);
+  }
+
+  char* tmpfile = writeTempCsv(csvData);
+  free(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  size_t first[2000] = {0};
+  bool ok = n <= sizeof(first) / sizeof(first[0]);
+  for (int run = 0; run < 2 && ok; run++) {
+    CsvParser* parser = csvparser_new(tmpfile);
+    CsvRow** rows = parser ? csvparser_sample(parser, n, 42) : NULL;
+    ok = rows && csvparser_numrows(parser) == n;
+
+    for (size_t i = 0; ok && i < n; i++) {
+      size_t id = strtoul(rows[i]->fields[0], NULL, 10);
+      ok = rows[i]->numFields == 2 && strtoul(rows[i]->fields[1], NULL, 10) == 2 * id &&
+           (i == 0 || id > strtoul(rows[i - 1]->fields[0], NULL, 10));
+      if (run == 0) {
+        first[i] = id;
+      } else {
+        ok = ok && first[i] == id;
       }
     }
+    csvparser_free(parser);
+  }
+
+  if (ok) {
     printf("Test passed\n");
+  } else {
+    printf("Test failed: sample of %zu rows out of %zu\n", n, numRows);
+    failures++;
+  }
+
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Count rows without parsing and check the count agrees with the parser.
+static void testCountRows(const char* csvData, size_t numExpectedRows) {
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  size_t counted = csvparser_count_rows(tmpfile, NULL, 4);
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  size_t parsed = parser && csvparser_parse(parser) ? csvparser_numrows(parser) : 0;
+  csvparser_free(parser);
+
+  if (counted == numExpectedRows && parsed == numExpectedRows) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: expected %zu rows, counted %zu, parsed %zu\n", numExpectedRows, counted, parsed);
+    failures++;
+  }
+
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Count a file large enough to be split between 4 threads (1 MB each at least),
+// with blank, comment and overlong lines scattered across the chunk boundaries.
+static void testCountRowsThreaded(void) {
+  const size_t numLines = 500000;
+  const size_t longLine = 1500;  // Read by the parser in several pieces
+  char* csvData = malloc(numLines * 12 + 1000 * (longLine + 20));
+  if (!csvData) {
+    failures++;
+    return;
+  }
+
+  // One column, so that the pieces of a long line are valid rows too.
+  size_t expected = 0;
+  char* p = csvData + sprintf(csvData, "value\n");
+  for (size_t i = 0; i < numLines; i++) {
+    if (i % 997 == 0) {
+      p += sprintf(p, "# comment\n\n  \t\n");
+    }
+    if (i % 4999 == 0) {
+      memset(p, 'x', longLine);
+      p += longLine;
+      *p++ = '\n';
+      expected += (longLine + MAX_FIELD_SIZE - 2) / (MAX_FIELD_SIZE - 1);
+    }
+    p += sprintf(p, "row%07zu\n", i);
+    expected++;
+  }
+
+  char* tmpfile = writeTempCsv(csvData);
+  free(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  size_t threaded = csvparser_count_rows(tmpfile, NULL, 4);
+  size_t single = csvparser_count_rows(tmpfile, NULL, 1);
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  size_t parsed = parser && csvparser_parse(parser) ? csvparser_numrows(parser) : 0;
+  csvparser_free(parser);
+
+  if (threaded == expected && single == expected && parsed == expected) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: expected %zu rows, counted %zu with 4 threads and %zu with 1, parsed %zu\n", expected,
+           threaded, single, parsed);
+    failures++;
+  }
+
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Lenient mode skips invalid rows and lists them instead of stopping.
+static void testLenientParse(void) {
+  const char* csvData =
+    "a,b\n"
+    "1,2\n"
+    "3\n"
+    "4,5,6\n"
+    "\"7,8\n"
+    "9,10\n";
+
+  CsvRow expectedRows[] = {
+    {.fields = (char*[]){"1", "2"}, .numFields = 2},
+    {.fields = (char*[]){"9", "10"}, .numFields = 2},
+  };
+
+  CsvError expectedErrors[] = {
+    {.row = 1, .offset = 8, .code = CSV_ERROR_FIELD_COUNT},
+    {.row = 2, .offset = 10, .code = CSV_ERROR_FIELD_COUNT},
+    {.row = 3, .offset = 16, .code = CSV_ERROR_UNTERMINATED_QUOTE},
+  };
+
+  char* tmpfile = writeTempCsv(csvData);
+  char* outfile = make_tempfile();
+  if (!tmpfile || !outfile) {
+    failures++;
+    free(tmpfile);
+    free(outfile);
+    return;
+  }
+
+  // Parsing and sorting report the same rows.
+  for (int sort = 0; sort < 2; sort++) {
+    CsvParser* parser = csvparser_new(tmpfile);
+    if (!parser) {
+      printf("Error creating CSV parser\n");
+      failures++;
+      break;
+    }
+
+    CSV_SETCONFIG(parser, .lenient = true);
+    bool ok;
+    if (sort) {
+      size_t key = 0;
+      ok = csvparser_sort_to_file(parser, &key, 1, outfile, 0);
+    } else {
+      CsvRow** rows = csvparser_parse(parser);
+      ok = rows && compareAllRows(expectedRows, 2, rows, csvparser_numrows(parser));
+    }
+
+    size_t numErrors = 0;
+    const CsvError* errors = csvparser_errors(parser, &numErrors);
+    ok = ok && numErrors == 3;
+    for (size_t i = 0; ok && i < numErrors; i++) {
+      ok = errors[i].row == expectedErrors[i].row && errors[i].offset == expectedErrors[i].offset &&
+           errors[i].code == expectedErrors[i].code;
+    }
+
+    if (ok) {
+      printf("Test passed\n");
+    } else {
+      printf("Test failed: lenient %s returned %zu errors\n", sort ? "sort" : "parse", numErrors);
+      failures++;
+    }
+    csvparser_free(parser);
+  }
+
+  remove(tmpfile);
+  remove(outfile);
+  free(tmpfile);
+  free(outfile);
+}
+
+// A lenient parse served from the snapshot reports the same errors as the parse that wrote it.
+static void testCachedErrors(void) {
+  const char* csvData =
+    "a,b\n"
+    "1,2\n"
+    "3\n"
+    "4,5\n";
+
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  char cachefile[512];
+  snprintf(cachefile, sizeof(cachefile), "%s.csvcache", tmpfile);
+
+  CsvConfig config = {.delim = ',', .quote = '"', .comment = '#', .has_header = true, .skip_header = true,
+                      .lenient = true};
+  bool ok = true;
+  for (int pass = 0; pass < 2 && ok; pass++) {
+    CsvParser* parser = csvparser_open_cached(tmpfile, &config, NULL);
+    size_t numErrors = 0;
+    const CsvError* errors = parser ? csvparser_errors(parser, &numErrors) : NULL;
+    ok = parser && csvparser_numrows(parser) == 2 && numErrors == 1 && errors[0].row == 1 &&
+         errors[0].offset == 8 && errors[0].code == CSV_ERROR_FIELD_COUNT;
+    if (!ok) {
+      printf("Test failed: cached lenient parse returned %zu errors on pass %d\n", numErrors, pass);
+    }
+    csvparser_free(parser);
+  }
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    failures++;
+  }
+
+  remove(cachefile);
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Remove a directory and the files directly inside it.
+static void removeDir(const char* dir) {
+  DIR* d = opendir(dir);
+  if (d) {
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        remove(path);
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir);
+}
+
+// Files with the same name, size and mtime in different directories do not share a snapshot.
+static void testCachedSameBasename(void) {
+  char* base = make_tempfile();
+  if (!base) {
+    failures++;
+    return;
+  }
+  remove(base);
+
+  char dir1[512], dir2[512], cacheDir[512], file1[512], file2[512];
+  snprintf(dir1, sizeof(dir1), "%s/d1", base);
+  snprintf(dir2, sizeof(dir2), "%s/d2", base);
+  snprintf(cacheDir, sizeof(cacheDir), "%s/cache", base);
+  snprintf(file1, sizeof(file1), "%s/d1/x.csv", base);
+  snprintf(file2, sizeof(file2), "%s/d2/x.csv", base);
+
+  bool ok = mkdir(base, 0700) == 0 && mkdir(dir1, 0700) == 0 && mkdir(dir2, 0700) == 0 && mkdir(cacheDir, 0700) == 0;
+  const char* paths[] = {file1, file2};
+  const char* contents[] = {"a,b\n1,2\n", "a,b\n9,9\n"};
+  struct utimbuf times = {.actime = 1000000000, .modtime = 1000000000};
+  for (int i = 0; i < 2 && ok; i++) {
+    FILE* file = fopen(paths[i], "w");
+    ok = file != NULL;
+    if (file) {
+      fputs(contents[i], file);
+      fclose(file);
+      ok = utime(paths[i], &times) == 0;
+    }
+  }
+  if (!ok) {
+    printf("Error creating temporary directories\n");
+  }
+
+  // Open the first file again once the second has been cached.
+  const char* expected[] = {"2", "9", "2"};
+  for (int i = 0; i < 3 && ok; i++) {
+    CsvParser* parser = csvparser_open_cached(paths[i % 2], NULL, cacheDir);
+    ok = parser && csvparser_numrows(parser) == 1 &&
+         strcmp(csvrow_field(csvparser_rows(parser)[0], 1), expected[i]) == 0;
+    if (!ok) {
+      printf("Test failed: cached open %d of %s did not return its own rows\n", i, paths[i % 2]);
+    }
+    csvparser_free(parser);
+  }
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    failures++;
+  }
+
+  removeDir(cacheDir);
+  removeDir(dir1);
+  removeDir(dir2);
+  rmdir(base);
+  free(base);
+}
+
+// csvparser_next splits quoted fields in place, collapsing doubled quotes.
+static void testStreamQuoted(void) {
+  const char* csvData =
+    "a,b\n"
+    "\"x\"\"y\",\"p,q\"\n"
+    "plain,\"\"\"\"\n"
+    "\"\",\"end\"\"\"";
+
+  const char* expected[][2] = {{"x\"y", "p,q"}, {"plain", "\""}, {"", "end\""}};
+  char* tmpfile = writeTempCsv(csvData);
+  if (!tmpfile) {
+    failures++;
+    return;
+  }
+
+  CsvParser* parser = csvparser_new(tmpfile);
+  bool ok = parser != NULL;
+  size_t numRows = 0;
+  CsvRow* row;
+  while (ok && (row = csvparser_next(parser)) != NULL) {
+    ok = numRows < 3 && row->numFields == 2 && strcmp(csvrow_field(row, 0), expected[numRows][0]) == 0 &&
+         strcmp(csvrow_field(row, 1), expected[numRows][1]) == 0;
+    if (!ok) {
+      printf("Test failed: streamed row %zu is [%s] [%s]\n", numRows, csvrow_field(row, 0), csvrow_field(row, 1));
+    }
+    numRows++;
+  }
+
+  if (ok && numRows != 3) {
+    printf("Test failed: streamed %zu rows, expected 3\n", numRows);
+    ok = false;
+  }
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    failures++;
   }
 
-  // Free resources
   csvparser_free(parser);
   remove(tmpfile);
+  free(tmpfile);
+}
+
+// A leading byte order mark is stripped; invalid UTF-8 is reported at the offending byte.
+static void testBomAndUtf8(void) {
+  const char* csvData =
+    "\xEF\xBB\xBFname,age\n"
+    "A,1\n"
+    "B,\xC3\x28\n"
+    "C,\xC3\xA9\n";
+
+  CsvRow expectedRows[] = {
+    {.fields = (char*[]){"name", "age"}, .numFields = 2},
+    {.fields = (char*[]){"A", "1"}, .numFields = 2},
+    {.fields = (char*[]){"C", "\xC3\xA9"}, .numFields = 2},
+  };
+
+  char* tmpfile = writeTempCsv(csvData);
+  CsvParser* parser = tmpfile ? csvparser_new(tmpfile) : NULL;
+  if (!parser) {
+    printf("Error creating CSV parser\n");
+    failures++;
+    free(tmpfile);
+    return;
+  }
+
+  CSV_SETCONFIG(parser, .skip_header = false, .lenient = true, .validate_utf8 = true);
+  CsvRow** rows = csvparser_parse(parser);
+  bool ok = rows && compareAllRows(expectedRows, 3, rows, csvparser_numrows(parser));
+
+  size_t numErrors = 0;
+  const CsvError* errors = csvparser_errors(parser, &numErrors);
+  ok = ok && numErrors == 1 && errors[0].row == 2 && errors[0].offset == 18 &&
+       errors[0].code == CSV_ERROR_INVALID_UTF8;
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: BOM and UTF-8 validation\n");
+    failures++;
+  }
+
+  csvparser_free(parser);
+  remove(tmpfile);
+  free(tmpfile);
+}
+
+// Index a key column and look up unique, duplicate and missing keys.
+static void testKeyIndex(void) {
+  const char* csvData =
+    "id,name\n"
+    "7,Alice\n"
+    "3,Bob\n"
+    "7,Carol\n"
+    "9,Dan\n";
+
+  char* tmpfile = writeTempCsv(csvData);
+  CsvParser* parser = tmpfile ? csvparser_new(tmpfile) : NULL;
+  if (!parser || !csvparser_parse(parser) || !csvparser_build_key_index(parser, 0)) {
+    printf("Test failed: unable to build key index\n");
+    failures++;
+    csvparser_free(parser);
+    free(tmpfile);
+    return;
+  }
+
+  CsvRow* matches[4] = {0};
+  bool ok = csvparser_lookup(parser, "7", matches, 4) == 2 && strcmp(matches[0]->fields[1], "Alice") == 0 &&
+            strcmp(matches[1]->fields[1], "Carol") == 0;
+  ok = ok && csvparser_lookup(parser, "9", matches, 4) == 1 && strcmp(matches[0]->fields[1], "Dan") == 0;
+  ok = ok && csvparser_lookup(parser, "3", NULL, 0) == 1;
+  ok = ok && csvparser_lookup(parser, "4", matches, 4) == 0;
+
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: key index lookups\n");
+    failures++;
+  }
+
+  csvparser_free(parser);
+  remove(tmpfile);
+  free(tmpfile);
 }
 
 int main() {
@@ -101,5 +809,44 @@ int main() {
     {.fields = (char*[]){"Charlie", "35"}, .numFields = 2},
   };
   runCsvParserTestCase(csvData, expectedRows2, 3, true, true);
-  return 0;
+
+  testCachedOpen(csvData, expectedRows2, 3);
+
+  // RFC 4180 quoting: delimiters and doubled quotes inside quoted fields
+  const char* quotedData =
+    "name,quote\n"
+    "Alice,\"say \"\"hi\"\"\"\n"
+    "\"Bob, Jr.\",plain\n"
+    "Carol,\"\"\"\"\n";
+
+  CsvRow quotedRows[] = {
+    {.fields = (char*[]){"Alice", "say \"hi\""}, .numFields = 2},
+    {.fields = (char*[]){"Bob, Jr.", "plain"}, .numFields = 2},
+    {.fields = (char*[]){"Carol", "\""}, .numFields = 2},
+  };
+  runCsvParserTestCase(quotedData, quotedRows, 3, true, true);
+  testCachedOpen(quotedData, quotedRows, 3);
+  testSortToFile();
+  testSortManyRuns();
+
+  // head stops early; a sample larger than the file returns every row in order
+  testHeadAndSample(csvData, expectedRows2, 2, false, 2);
+  testHeadAndSample(csvData, expectedRows2, 3, true, 10);
+  testHeadAndSample(csvData, expectedRows2, 3, true, SIZE_MAX);
+  // few rows picked by seeking, then enough that picks collide and are redrawn
+  testSampleLarge(25);
+  testSampleLarge(2000);
+
+  testCountRows(csvData, 3);
+  testCountRows("# comment\nname,age\n\n  \nA,1\n# another comment\nB,2\r\n\nC,3", 3);
+
+  testLenientParse();
+  testCachedErrors();
+  testCachedSameBasename();
+  testStreamQuoted();
+  testBomAndUtf8();
+  testKeyIndex();
+  testCountRows("\xEF\xBB\xBF# comment after a byte order mark\nname,age\nA,1\n", 1);
+  testCountRowsThreaded();
+  return failures == 0 ? 0 : 1;
 }
@@ -0,0 +1,101 @@
+#include <solidc/filepath.h>
+#include "../csvparser.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Number of failed checks; returned as the exit status.
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+  if (ok) {
+    printf("Test passed\n");
+  } else {
+    printf("Test failed: %s\n", what);
+    failures++;
+  }
+}
+
+int main() {
+  const char* csvData =
+    "name,quote\n"
+    "Alice,\"say \"\"hi\"\"\"\n"
+    "Bob,plain\n"
+    "Carol,\"a, b\"\n"
+    "Dave,plain\n";
+
+  char* tmpfile = make_tempfile();
+  if (!tmpfile) {
+    printf("Error creating temporary file\n");
+    return 1;
+  }
+
+  FILE* file = fopen(tmpfile, "w");
+  if (!file) {
+    printf("Error creating temporary file\n");
+    free(tmpfile);
+    return 1;
+  }
+  fputs(csvData, file);
+  fclose(file);
+
+  // Eager parse with random access over rows and fields.
+  {
+    csv::Parser parser(tmpfile);
+    csv::Rows rows = parser.parse();
+    check(rows.size() == 4 && rows[0][1] == "say \"hi\"" && rows[2][1] == "a, b", "parse");
+
+    std::vector<std::string_view> fields(rows[1].begin(), rows[1].end());
+    check(fields.size() == 2 && fields[0] == "Bob" && fields[1] == "plain", "row iteration");
+
+    // Moving transfers ownership; the moved-from parser frees nothing.
+    csv::Parser moved = std::move(parser);
+    check(moved.size() == 4 && parser.get() == nullptr, "move");
+  }
+
+  // Lazy stream, stopped early by a capturing lambda.
+  {
+    csv::Parser parser(tmpfile);
+    std::string names;
+    size_t seen = parser.for_each([&names](size_t index, csv::Row row) {
+      names += std::string(row[0]);
+      return index == 1;
+    });
+    check(seen == 2 && names == "AliceBob", "for_each");
+
+    // Streamed rows are not collected, so there is nothing to index.
+    bool threw = false;
+    try {
+      parser.build_key_index(0);
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    check(threw && parser.size() == 0 && parser.rows().empty(), "index after stream");
+  }
+
+  // Lookups through the key index.
+  {
+    csv::Parser parser(tmpfile);
+    parser.parse();
+    parser.build_key_index(0);
+    std::vector<csv::Row> carol = parser.lookup("Carol");
+    check(carol.size() == 1 && carol[0].at(1) == "a, b" && parser.lookup("Dan").empty(), "lookup");
+  }
+
+  // Duplicate keys: every match is returned, in file order.
+  {
+    csv::Parser parser(tmpfile);
+    parser.parse();
+    parser.build_key_index(1);
+    std::vector<csv::Row> plain = parser.lookup("plain");
+    check(plain.size() == 2 && plain[0][0] == "Bob" && plain[1][0] == "Dave", "lookup duplicates");
+  }
+
+  remove(tmpfile);
+  free(tmpfile);
+  return failures == 0 ? 0 : 1;
+}